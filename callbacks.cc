@@ -20,9 +20,17 @@
 
 #include <iostream>
 #include <mutex>
+#include <vector>
+#include <unordered_map>
+#include <deque>
+#include <condition_variable>
+#include <thread>
+#include <algorithm>
+#include <stdint.h>
 #include <timer.h>
 #include "callbacks.h"
 #include "graph.h"
+#include "monitor.h"
 //#include "barrier.h"
 
 #ifdef HAVE_PAPI
@@ -30,6 +38,10 @@
 #endif
 
 
+#define SITE_CACHE_SIZE		64
+#define GOVERNOR_MIN_CHUNKS	64		// Chunks measured before the overhead of a loop site is judged
+
+
 #define TRACE_CALLBACK(cb)											\
 	std::cout << "libtdg: " << cb << std::endl;						\
 
@@ -72,6 +84,51 @@ namespace libtdg
 	Graph*					g_tdg = NULL;
 	Node*					g_finalNode = NULL;
 	
+	double					g_coalesceTime = 0.0;	// Chunks are coalesced into nodes shorter than this (ms)
+	bool					g_useTemplates = false;	// Fold repeated top-level region instances into templates
+	double					g_sampleRate = 0.0;		// Every Nth top-level instance if >= 1, probability if < 1
+	std::mt19937			g_sampleRng;
+	
+	std::mutex								g_sampleMutex;
+	std::unordered_map<uint32_t, uint64_t>	g_siteInstances;	// Top-level instances seen per site
+	
+	double					g_overheadBudget = 0.0;	// Tool time per chunk relative to the chunk time, 0 is off
+	InstrumentationLevel	g_level = LEVEL_FULL;
+	
+	std::atomic<bool>		g_captureOn( true );	// Requested by ompt_control, applied at the next top-level region
+	bool					g_capturing = true;		// The last top-level region was captured
+	bool					g_inTopRegion = false;	// A captured top-level region is running
+	std::atomic<int>		g_topRegionsInFlight( 0 );	// Top-level instances whose stats are not released
+	uint64_t				g_captureFirst = 0;		// Window of captured top-level regions
+	uint64_t				g_captureLast = UINT64_MAX;
+	uint64_t				g_numTopRegions = 0;
+	
+	MonitorSegment*			g_monitor = NULL;		// Live counters for tdg-top (TDG_MONITOR)
+	thread_local MonitorThread*	t_monitorThread = NULL;
+	
+	bool					g_snapshots = false;	// Snapshots of the completed regions (SIGUSR1, TDG_SNAPSHOT_INTERVAL)
+	std::atomic<int64_t>	g_snapshotWatermark( 0 );
+	std::atomic<int64_t>	g_serialNodeId( 0 );	// Node of the sequential code that is running
+	std::mutex				g_openRegionsMutex;
+	std::deque<int64_t>		g_openRegions;			// First node ids of the running top-level instances
+	
+	bool							g_regionFinalize = false;	// Hand completed top-level instances to a worker
+	std::mutex						g_finalizedMutex;
+	std::condition_variable			g_finalizedCond;
+	std::deque<FinalizedRegion>		g_finalizedRegions;
+	bool							g_finalizedStop = false;
+	uint64_t						g_numFinalized = 0;
+	size_t							g_finalizedPending = 0;	// Queued or being printed
+	
+	std::mutex						g_monitoredMutex;
+	std::condition_variable			g_monitoredCond;
+	std::deque<MonitoredRegion>		g_monitoredRegions;
+	bool							g_monitoredStop = false;
+	size_t							g_monitoredPending = 0;	// Queued or being measured
+	
+	bool					g_selfProfile = false;		// Measure the callbacks for the self metric
+	thread_local CallbackProfile*	t_callbackProfile = NULL;
+	
 	int						g_thread_cnt = 0;
 	
 #ifdef HAVE_PAPI
@@ -81,19 +138,139 @@ namespace libtdg
 
 	/*======================== Definitions ========================*/
 	
+	// Capture detail of the chunks of a loop site, lowered by the overhead governor
+	enum CaptureLevel
+	{
+		CAPTURE_DETAILED = 0,	// A node per chunk
+		CAPTURE_COALESCED,		// Chunks are coalesced into nodes of at least the coalesce time
+		CAPTURE_AGGREGATE,		// A node per thread, chunks are only counted and timed
+		NUM_CAPTURE_LEVELS
+	};
+	
+	const char* g_captureLevelStrings[NUM_CAPTURE_LEVELS] = { "detailed", "coalesced", "aggregate" };
+	
+	// Tool time in the chunk callbacks against the time of the threads in the loops of a site,
+	// since the last change of the capture level
+	struct GovernorSite
+	{
+		GovernorSite() : _level( CAPTURE_DETAILED ), _numChunks( 0 ), _toolTime( 0.0 ), _loopTime( 0.0 ), 
+						 _coalesceTime( 0.0 ) {}
+		
+		CaptureLevel	_level;
+		uint64_t		_numChunks;
+		double			_toolTime;
+		double			_loopTime;
+		double			_coalesceTime;
+		double			_overhead[NUM_CAPTURE_LEVELS];	// Overhead that caused the downgrade from a level
+	};
+	
+	std::mutex									g_governorMutex;
+	std::unordered_map<uint32_t, GovernorSite>	g_governorSites;
+	
 	struct WorksharingData
 	{
-		WorksharingData() : _start_node( NULL ), _sink_node( NULL ), _last_chunk_node( NULL ) {}
+		WorksharingData() : _start_node( NULL ), _sink_node( NULL ), _last_chunk_node( NULL ), _loop( NULL ),
+							_loop_index( 0 ), _thread_lower( 0 ), _start_time( 0.0 ), _level( CAPTURE_DETAILED ),
+							_coalesce_time( g_coalesceTime ), _num_chunks( 0 ), _tool_time( 0.0 ) {}
 		
 		Node* _start_node;
 		Node* _sink_node;
 		Node* _last_chunk_node;
+		LoopInfo* _loop;
+		unsigned int _loop_index;	// Index of the loop in the parallel region
+		int64_t _thread_lower;		// First iteration of the thread in static loops
+		double _start_time;
+		CaptureLevel _level;
+		double _coalesce_time;
+		uint64_t _num_chunks;		// Chunk callbacks of the thread and the time spent in them
+		double _tool_time;
+	};
+	
+	// Time span and work of one loop instance, collected from all the threads of the team
+	struct LoopSpan
+	{
+		LoopSpan( uint32_t site_id, unsigned int team_size ) 
+			: _site_id( site_id ), _team_size( team_size ), _start( 0.0 ), _end( 0.0 ), _work( 0.0 ), _num_done( 0 ) {}
+		
+		uint32_t		_site_id;
+		unsigned int	_team_size;
+		double			_start;
+		double			_end;
+		double			_work;
+		unsigned int	_num_done;
 	};
 	
+	// Work of one parallel region instance. The implicit task end of the workers may be reported 
+	// after the parallel end, so the instance is recorded by the last one to release it. A nested
+	// region holds a reference to its parent, so an instance is released after all the nested ones.
+	struct RegionStats
+	{
+		RegionStats( uint32_t site_id ) : _site_id( site_id ), _refs( 1 ), _num_threads( 0 ), _span( 0.0 ), _work( 0.0 ),
+										  _parent( NULL ), _entry_node( NULL ), _entry_exits( 0 ), _sink_node( NULL ), 
+										  _first_loop( 0 ), _top_level( false ), _first_id( 0 ) {}
+		
+		uint32_t		_site_id;
+		unsigned int	_refs;
+		unsigned int	_num_threads;
+		double			_span;
+		double			_work;
+		std::mutex		_mutex;
+		RegionStats*	_parent;
+		
+		// Boundary of a detailed top-level instance in the graph, for templates and sampling
+		Node*			_entry_node;
+		size_t			_entry_exits;
+		Node*			_sink_node;
+		uint64_t		_first_loop;
+		bool			_top_level;
+		int64_t			_first_id;		// Node ids of a top-level instance start here, for snapshots
+	};
+	
+	struct TaskData;
+	
+	// Measures the TSC cycles of a callback, from the start of the callback to its return
+	struct SelfTimer
+	{
+		SelfTimer( ToolCallback callback ) : _callback( callback ), _start( g_selfProfile ? ftimer_cycles() : 0 ) {}
+		
+		~SelfTimer()
+		{
+			if( !_start )
+				return;
+			uint64_t cycles = ftimer_cycles() - _start;
+			if( !t_callbackProfile )
+			{
+				t_callbackProfile = new CallbackProfile( NUM_TOOL_CALLBACKS );
+				g_tdg->registerCallbackProfile( t_callbackProfile );
+			}
+			(*t_callbackProfile)[_callback].add( cycles );
+		}
+		
+		ToolCallback	_callback;
+		uint64_t		_start;
+	};
+	
+	// Last writer and the readers after it of one dependence address
+	struct DependenceEntry
+	{
+		DependenceEntry() : _last_writer( NULL ) {}
+		
+		TaskData*				_last_writer;
+		std::vector<TaskData*>	_readers;
+	};
+	
+	// Dependences order only sibling tasks, which are created by the same task (and thread),
+	// so every task keeps the table of its children and no locking is needed
+	typedef std::unordered_map<const void*, DependenceEntry> DependenceTable;
+	
 	struct TaskData
 	{
 		TaskData() : _curr_task_node( NULL ), _curr_ws_data( NULL ), _curr_barrier_node( NULL ),
-					 _sink_node( NULL ), _threadNum( 0 ) {}
+					 _sink_node( NULL ), _threadNum( 0 ), _teamSize( 1 ), _loopIndex( 0 ), _site_id( 0 ),
+					 _parent_task( NULL ), _dep_table( NULL ), _dep_first_seq( 0 ), _create_seq( 0 ), _num_created( 0 ),
+					 _completed( false ), _in_sync( false ),
+					 _sync_node_type( Node::EXP_TASK ), _busy_time( 0.0 ), _busy_start( 0.0 ), _region_stats( NULL ),
+					 _detailed( true ), _refs( 1 ) {}
 		
 		Node* 				_curr_task_node;
 		WorksharingData*	_curr_ws_data;
@@ -104,13 +281,37 @@ namespace libtdg
 		Node* 				_sink_node;
 		
 		int					_threadNum;
+		unsigned int		_teamSize;
+		unsigned int		_loopIndex;		// Number of loops encountered by the implicit task
+		uint32_t			_site_id;		// Site of the parallel region or the task construct
+		
+		TaskData*				_parent_task;
+		DependenceTable*		_dep_table;		// Dependences of the children
+		std::vector<TaskData*>	_dep_preds;		// Predecessors to connect when the task starts
+		uint64_t				_dep_first_seq;	// Creation number of the first child in the table
+		
+		uint64_t				_create_seq;	// Creation number of the task among its siblings
+		uint64_t				_num_created;	// Number of children created so far
+		std::vector<uint64_t>	_taskgroup_marks;	// Creation number of the first child of every open taskgroup
+		std::vector<TaskData*>	_children;		// Children that are not joined by a taskwait node yet
+		std::atomic<bool>		_completed;		// Set by the thread that completes the task
+		bool					_in_sync;		// Waiting in a taskwait or a taskgroup
+		Node::NodeType			_sync_node_type;	// Type of the node that follows the wait
+		
+		// Time the task runs, without the time it waits or other tasks run on its thread
+		double					_busy_time;
+		double					_busy_start;
+		RegionStats*			_region_stats;	// Of the innermost parallel region
+		bool					_detailed;		// False in region instances that are not sampled, the task has no nodes
+		std::atomic<unsigned int>	_refs;		// See acquire_task
 	};
 	
 	struct ParallelRegionData
 	{
 		ParallelRegionData() 
 			: _parent_task_data( NULL ), _sink_node( NULL ), _team_size( 0 ), 
-			  _barrier_cnt( 0 ), _curr_barrier_node( NULL ) {}
+			  _barrier_cnt( 0 ), _curr_barrier_node( NULL ), _site_id( 0 ), _stats( NULL ), _start_time( 0.0 ),
+			  _detailed( true ) {}
 		
 		TaskData* 			_parent_task_data;
 		Node* 				_sink_node;
@@ -118,11 +319,18 @@ namespace libtdg
 		unsigned int		_barrier_cnt;
 		Node*				_curr_barrier_node;
 		std::mutex 			_barrier_mutex;
+		uint32_t			_site_id;
+		RegionStats*		_stats;
+		double				_start_time;
+		bool				_detailed;
+		// Loops of the region in the order they are encountered by the team
+		std::vector<LoopInfo*>	_loops;
+		std::vector<LoopSpan>	_loop_spans;
+		std::mutex				_loops_mutex;
 	};
 	
 	struct ThreadData
 	{
-		uint64_t			_loopCounter;
 #ifdef HAVE_PAPI
 		int					_papiEventset;
 #endif
@@ -136,10 +344,350 @@ namespace libtdg
 		int64_t nid = gen_id ? Node::nextId() : 0;
 		Node* node = new Node( nid, type, 0 );
 		g_tdg->addNode( nid, node );
+		if( t_monitorThread )
+			monitor_add( t_monitorThread->_nodes, 1 );
 		
 		return node;
 	}
 	
+	// Per-thread cache in front of the site table of the graph, so that constructs that are
+	// executed repeatedly are interned without taking its lock
+	// The filter decision (TDG_FILTER) of a site is cached together with its id
+	uint32_t intern_site( const void* codeptr_ra, bool* selected = NULL )
+	{
+		static thread_local const void*	cached_codeptrs[SITE_CACHE_SIZE];
+		static thread_local uint32_t	cached_ids[SITE_CACHE_SIZE];
+		static thread_local bool		cached_selected[SITE_CACHE_SIZE];
+		
+		uintptr_t addr = (uintptr_t)codeptr_ra;
+		unsigned int slot = (addr ^ (addr >> 6)) % SITE_CACHE_SIZE;
+		if( cached_codeptrs[slot] != codeptr_ra || !cached_codeptrs[slot] )
+		{
+			cached_ids[slot] = g_tdg->internSite( codeptr_ra, &cached_selected[slot] );
+			cached_codeptrs[slot] = codeptr_ra;
+		}
+		if( selected )
+			*selected = cached_selected[slot];
+		return cached_ids[slot];
+	}
+	
+	// Every thread aggregates the instances of the call sites in its own table, the tables
+	// are merged when the metrics are computed
+	void record_site_instance( uint32_t site_id, SiteStats::SiteKind kind, double time, double work, double capacity )
+	{
+		static thread_local SiteStatsTable* site_stats = NULL;
+		
+		if( !site_stats )
+		{
+			site_stats = new SiteStatsTable;
+			g_tdg->registerSiteStats( site_stats );
+		}
+		(*site_stats)[site_id].addInstance( kind, time, work, capacity );
+	}
+	
+	void pause_task( TaskData* task_data, double curr_time )
+	{
+		task_data->_busy_time += curr_time - task_data->_busy_start;
+		if( t_monitorThread )
+			monitor_add( t_monitorThread->_busyNs, (uint64_t)((curr_time - task_data->_busy_start) * 1e6) );
+	}
+	
+	void resume_task( TaskData* task_data, double curr_time )
+	{
+		task_data->_busy_start = curr_time;
+	}
+	
+	void add_region_work( RegionStats* stats, double work )
+	{
+		if( stats )
+		{
+			stats->_mutex.lock();
+			stats->_work += work;
+			stats->_mutex.unlock();
+		}
+	}
+	
+	// Decides if a top-level region instance is captured in detail. Counting is per site,
+	// so every region of the program is sampled at the same rate.
+	bool sample_region( uint32_t site_id )
+	{
+		if( g_sampleRate <= 0.0 )
+			return true;
+		
+		bool sampled;
+		g_sampleMutex.lock();
+		if( g_sampleRate >= 1.0 )
+			sampled = (g_siteInstances[site_id]++ % (uint64_t)g_sampleRate) == 0;
+		else
+			sampled = std::uniform_real_distribution<double>( 0.0, 1.0 )( g_sampleRng ) < g_sampleRate;
+		g_sampleMutex.unlock();
+		return sampled;
+	}
+	
+	// The capture level of a loop site is read when a thread starts a loop instance
+	void set_capture_level( WorksharingData* ws_data, uint32_t site_id )
+	{
+		g_governorMutex.lock();
+		GovernorSite& site = g_governorSites[site_id];
+		ws_data->_level = site._level;
+		ws_data->_coalesce_time = std::max( g_coalesceTime, site._coalesceTime );
+		g_governorMutex.unlock();
+	}
+	
+	// When the tool time exceeds the budget, the site goes down one capture level. Coalesced
+	// nodes must be long enough for the measured tool time per chunk to fit in the budget.
+	void govern_loop_site( WorksharingData* ws_data, double loop_time )
+	{
+		uint32_t site_id = ws_data->_loop->getSiteId();
+		
+		g_governorMutex.lock();
+		GovernorSite& site = g_governorSites[site_id];
+		if( site._level == ws_data->_level && site._level < CAPTURE_AGGREGATE )
+		{
+			site._numChunks += ws_data->_num_chunks;
+			site._toolTime += ws_data->_tool_time;
+			site._loopTime += loop_time;
+			
+			double app_time = site._loopTime - site._toolTime;
+			double overhead = (app_time > 0.0) ? (site._toolTime / app_time) : 0.0;
+			if( site._numChunks >= GOVERNOR_MIN_CHUNKS && overhead > g_overheadBudget )
+			{
+				site._overhead[site._level] = overhead;
+				site._coalesceTime = (site._toolTime / site._numChunks) / g_overheadBudget;
+				site._level = (CaptureLevel)(site._level + 1);
+				site._numChunks = 0;
+				site._toolTime = 0.0;
+				site._loopTime = 0.0;
+			}
+		}
+		g_governorMutex.unlock();
+	}
+	
+	// The time of the chunk callbacks is measured for the governor and published to the monitor
+	void count_chunk( WorksharingData* ws_data, double tool_time )
+	{
+		ws_data->_num_chunks++;
+		ws_data->_tool_time += tool_time;
+		if( t_monitorThread )
+		{
+			monitor_add( t_monitorThread->_chunks, 1 );
+			monitor_add( t_monitorThread->_toolNs, (uint64_t)(tool_time * 1e6) );
+		}
+	}
+	
+	void print_governor( std::ostream& out_stream )
+	{
+		for( std::unordered_map<uint32_t, GovernorSite>::const_iterator it = g_governorSites.begin(); 
+			 it != g_governorSites.end(); ++it )
+		{
+			const GovernorSite& site = it->second;
+			for( int level = CAPTURE_DETAILED; level < site._level; ++level )
+			{
+				out_stream << "libtdg: governor downgraded site " << g_tdg->getSiteName( it->first )
+						   << " from " << g_captureLevelStrings[level] << " to " << g_captureLevelStrings[level + 1]
+						   << " capture, overhead " << (100.0 * site._overhead[level]) << "%" << std::endl;
+			}
+		}
+	}
+	
+	// Decides if a top-level region is captured. Top-level regions start on the initial thread, so
+	// the capture state changes only in sequential code. The time of the master between captured
+	// regions is not part of its node.
+	bool capture_region( TaskData* parent_task, double curr_time )
+	{
+		bool capture = g_captureOn && g_numTopRegions >= g_captureFirst && g_numTopRegions <= g_captureLast;
+		g_numTopRegions++;
+		
+		if( parent_task->_detailed && capture != g_capturing )
+		{
+			if( capture )
+				parent_task->_curr_task_node->setLastTime( curr_time );
+			else
+				parent_task->_curr_task_node->addTime( curr_time );
+		}
+		g_capturing = capture;
+		return capture;
+	}
+	
+	// The nodes below the watermark are final: the watermark is the first node id of the oldest
+	// top-level instance that has not been released, or the next id if there is none. Top-level
+	// regions begin in order, but the workers of an instance may release it after the next begins.
+	void open_snapshot_region( RegionStats* stats )
+	{
+		g_openRegionsMutex.lock();
+		stats->_first_id = Node::peekNextId();
+		g_openRegions.push_back( stats->_first_id );
+		g_openRegionsMutex.unlock();
+	}
+	
+	void close_snapshot_region( RegionStats* stats )
+	{
+		g_openRegionsMutex.lock();
+		g_openRegions.erase( std::find( g_openRegions.begin(), g_openRegions.end(), stats->_first_id ) );
+		g_snapshotWatermark = g_openRegions.empty() ? Node::peekNextId() : g_openRegions.front();
+		g_openRegionsMutex.unlock();
+	}
+	
+	// The node of the sequential code that is running is not final either, the snapshots are cut
+	// below it. It is published after its predecessor is closed, so the nodes below it are final.
+	void set_serial_node( Node* node )
+	{
+		if( g_snapshots && node->getType() == Node::ROOT_TASK )
+			g_serialNodeId = node->getId();
+	}
+	
+	// The instance is replaced by one node with its span, so the critical path of the graph does 
+	// not change, and its nodes are handed to the worker that prints its metrics and deletes them
+	void finalize_region( RegionStats* stats, double span )
+	{
+		Graph* region_graph = new Graph();
+		if( !g_tdg->extractInstance( stats->_entry_node, stats->_entry_exits, stats->_sink_node, *region_graph ) )
+		{
+			delete region_graph;
+			return;
+		}
+		
+		Node* summary = create_clean_node( Node::IMP_TASK, true );
+		summary->setSiteId( stats->_site_id );
+		summary->setTotalTime( span );
+		Graph::connectNodes( stats->_entry_node, summary );
+		Graph::connectNodes( summary, stats->_sink_node );
+		
+		g_finalizedMutex.lock();
+		FinalizedRegion region = { region_graph, span, stats->_site_id, g_numFinalized++ };
+		g_finalizedRegions.push_back( region );
+		g_finalizedPending++;
+		g_finalizedMutex.unlock();
+		g_finalizedCond.notify_one();
+	}
+	
+	bool wait_finalized_region( FinalizedRegion& region )
+	{
+		std::unique_lock<std::mutex> lock( g_finalizedMutex );
+		while( g_finalizedRegions.empty() && !g_finalizedStop )
+			g_finalizedCond.wait( lock );
+		if( g_finalizedRegions.empty() )
+			return false;
+		region = g_finalizedRegions.front();
+		g_finalizedRegions.pop_front();
+		return true;
+	}
+	
+	void done_finalized_region()
+	{
+		g_finalizedMutex.lock();
+		g_finalizedPending--;
+		g_finalizedMutex.unlock();
+		g_finalizedCond.notify_all();
+	}
+	
+	void stop_finalized_regions()
+	{
+		g_finalizedMutex.lock();
+		g_finalizedStop = true;
+		g_finalizedMutex.unlock();
+		g_finalizedCond.notify_all();
+	}
+	
+	void monitor_region( RegionStats* stats )
+	{
+		g_monitoredMutex.lock();
+		MonitoredRegion region = { stats->_entry_node, stats->_entry_exits, stats->_sink_node, stats->_span };
+		g_monitoredRegions.push_back( region );
+		g_monitoredPending++;
+		g_monitoredMutex.unlock();
+		g_monitoredCond.notify_one();
+	}
+	
+	bool wait_monitored_region( MonitoredRegion& region )
+	{
+		std::unique_lock<std::mutex> lock( g_monitoredMutex );
+		while( g_monitoredRegions.empty() && !g_monitoredStop )
+			g_monitoredCond.wait( lock );
+		if( g_monitoredRegions.empty() )
+			return false;
+		region = g_monitoredRegions.front();
+		g_monitoredRegions.pop_front();
+		return true;
+	}
+	
+	void done_monitored_region()
+	{
+		g_monitoredMutex.lock();
+		g_monitoredPending--;
+		g_monitoredMutex.unlock();
+		g_monitoredCond.notify_all();
+	}
+	
+	void stop_monitored_regions()
+	{
+		g_monitoredMutex.lock();
+		g_monitoredStop = true;
+		g_monitoredMutex.unlock();
+		g_monitoredCond.notify_all();
+	}
+	
+	void wait_settled_regions()
+	{
+		// The implicit tasks of the workers may still end after the parallel end of the master
+		while( g_topRegionsInFlight.load() > 0 )
+			std::this_thread::yield();
+		
+		std::unique_lock<std::mutex> finalized_lock( g_finalizedMutex );
+		while( g_finalizedPending > 0 )
+			g_finalizedCond.wait( finalized_lock );
+		finalized_lock.unlock();
+		
+		std::unique_lock<std::mutex> monitored_lock( g_monitoredMutex );
+		while( g_monitoredPending > 0 )
+			g_monitoredCond.wait( monitored_lock );
+	}
+	
+	void release_region_stats( RegionStats* stats, double work, double span )
+	{
+		stats->_mutex.lock();
+		stats->_work += work;
+		stats->_span += span;
+		bool last_ref = (--stats->_refs == 0);
+		stats->_mutex.unlock();
+		
+		if( last_ref )
+		{
+			record_site_instance( stats->_site_id, SiteStats::REGION_SITE, stats->_span, stats->_work, 
+								  stats->_span * stats->_num_threads );
+			double work = 0.0, span = 0.0;
+			bool measured = stats->_entry_node && (g_sampleRate > 0.0 || g_regionFinalize);
+			if( measured )
+				g_tdg->measureInstance( stats->_entry_node, stats->_entry_exits, stats->_sink_node, work, span );
+			if( stats->_top_level && g_sampleRate > 0.0 )
+				g_tdg->recordSample( stats->_site_id, stats->_entry_node != NULL, stats->_work, work, span );
+			if( stats->_entry_node && g_regionFinalize )
+				finalize_region( stats, span );
+			else if( stats->_entry_node && g_useTemplates )
+				measured |= g_tdg->foldInstance( stats->_entry_node, stats->_entry_exits, stats->_sink_node, 
+												 stats->_first_loop, stats->_site_id, &span );
+			
+			// The monitor takes the critical path when it is known, otherwise the instance is still
+			// in the graph and is measured in the background
+			if( stats->_top_level && g_monitor )
+			{
+				if( measured )
+					g_monitor->_savedNs.fetch_add( (uint64_t)(std::max( 0.0, stats->_span - span ) * 1e6) );
+				else if( stats->_entry_node )
+					monitor_region( stats );
+				g_monitor->_numRegions.fetch_add( 1 );
+			}
+			if( stats->_top_level && g_snapshots )
+				close_snapshot_region( stats );
+			if( stats->_parent )
+				release_region_stats( stats->_parent, 0.0, 0.0 );
+			bool top_level = stats->_top_level;
+			delete stats;
+			if( top_level )
+				g_topRegionsInFlight.fetch_sub( 1 );
+		}
+	}
+	
 	Node* create_new_node( Node::NodeType type, Node* parent_node, bool set_time = true )
 	{
 		Node* node = create_clean_node( type, parent_node != NULL );
@@ -150,6 +698,269 @@ namespace libtdg
 		return node;
 	}
 	
+	// Returns the loop instance shared by the team. The first thread that reaches the loop
+	// creates it, the rest find it by the index of the loop in the parallel region. This keeps
+	// the loop ids consistent among the threads even if teams of different sizes are used.
+	LoopInfo* get_team_loop( ParallelRegionData* par_info, TaskData* task_data, ext_loop_sched_t loop_sched,
+							 int64_t lower, int64_t upper, int64_t step, uint64_t chunk_size, const void* codeptr_ra )
+	{
+		LoopInfo* loop = NULL;
+		unsigned int loop_idx = task_data->_loopIndex++;
+		
+		// The loops of region instances that are not sampled have no loop info in the graph, they
+		// are only counted in the statistics of their site
+		par_info->_loops_mutex.lock();
+		if( loop_idx >= par_info->_loops.size() )
+		{
+			uint32_t site_id = intern_site( codeptr_ra );
+			if( task_data->_detailed )
+				loop = g_tdg->createLoop( codeptr_ra, site_id, loop_sched, lower, upper, step, chunk_size, task_data->_teamSize );
+			par_info->_loops.push_back( loop );
+			par_info->_loop_spans.push_back( LoopSpan( site_id, task_data->_teamSize ) );
+		}
+		else
+		{
+			loop = par_info->_loops[loop_idx];
+		}
+		par_info->_loops_mutex.unlock();
+		
+		return loop;
+	}
+	
+	// The last thread of the team to finish the loop records the loop instance
+	void finish_loop_span( ParallelRegionData* par_info, WorksharingData* ws_data, double end_time )
+	{
+		par_info->_loops_mutex.lock();
+		LoopSpan& span = par_info->_loop_spans[ws_data->_loop_index];
+		span._start = (span._num_done == 0) ? ws_data->_start_time : std::min( span._start, ws_data->_start_time );
+		span._end = std::max( span._end, end_time );
+		span._work += end_time - ws_data->_start_time;
+		bool last_thread = (++span._num_done == span._team_size);
+		LoopSpan loop_span = span;
+		par_info->_loops_mutex.unlock();
+		
+		if( last_thread )
+		{
+			double duration = loop_span._end - loop_span._start;
+			record_site_instance( loop_span._site_id, SiteStats::LOOP_SITE, duration, loop_span._work, 
+								  duration * loop_span._team_size );
+		}
+	}
+	
+	// Static loops have no chunk callbacks, so the chunks of the thread are computed from the
+	// loop bounds and the time of the thread in the loop is divided among them according to
+	// the number of iterations in each chunk.
+	void create_static_chunks( TaskData* task_data, double loop_time )
+	{
+		WorksharingData* ws_data = task_data->_curr_ws_data;
+		LoopInfo* loop = ws_data->_loop;
+		int64_t step = (loop->getStep() != 0) ? loop->getStep() : 1;
+		int64_t num_iters = std::max( (int64_t)0, (loop->getUpper() - loop->getLower()) / step + 1 );
+		int64_t num_threads = std::max( task_data->_teamSize, 1u );
+		int64_t tid = task_data->_threadNum;
+		int64_t chunk_size = loop->getChunkSize();
+		
+		// Chunks of the thread as [first, last) iteration indices
+		std::vector< std::pair<int64_t, int64_t> > chunks;
+		int64_t thread_iters = 0;
+		if( chunk_size == 0 )
+		{
+			// The runtime gives ceil(n/nth) iterations to each thread (greedy, the default in
+			// LLVM) or splits the iterations evenly (balanced), thread_lower tells which one is used.
+			int64_t thread_first = (ws_data->_thread_lower - loop->getLower()) / step;
+			int64_t big_block = (num_iters + num_threads - 1) / num_threads;
+			int64_t first = std::min( num_iters, tid * big_block );
+			int64_t last = std::min( num_iters, first + big_block );
+			int64_t small_block = num_iters / num_threads;
+			int64_t extras = num_iters % num_threads;
+			if( first != thread_first && tid * small_block + std::min( tid, extras ) == thread_first )
+			{
+				first = thread_first;
+				last = first + small_block + ((tid < extras) ? 1 : 0);
+			}
+			if( last > first )
+				chunks.push_back( std::make_pair( first, last ) );
+		}
+		else
+		{
+			for( int64_t first = tid * chunk_size; first < num_iters; first += num_threads * chunk_size )
+				chunks.push_back( std::make_pair( first, std::min( num_iters, first + chunk_size ) ) );
+		}
+		
+		for( unsigned int i = 0; i < chunks.size(); ++i )
+			thread_iters += chunks[i].second - chunks[i].first;
+		
+		if( thread_iters == 0 )
+		{
+			ws_data->_start_node->setTotalTime( loop_time );
+			Graph::connectNodes( ws_data->_start_node, ws_data->_sink_node );
+			return;
+		}
+		
+		Node* chunk_node = NULL;
+		for( unsigned int i = 0; i < chunks.size(); ++i )
+		{
+			int64_t chunk_lower = loop->getLower() + chunks[i].first * step;
+			int64_t chunk_upper = loop->getLower() + (chunks[i].second - 1) * step;
+			int64_t chunk_iters = chunks[i].second - chunks[i].first;
+			if( chunk_node && chunk_node->getTotalTime() < g_coalesceTime )
+			{
+				chunk_node->coalesceChunk( chunk_lower, chunk_upper, chunk_iters );
+				chunk_node->addChunkTime( loop_time * chunk_iters / thread_iters );
+				continue;
+			}
+			
+			chunk_node = create_new_node( Node::CHUNK_TASK, ws_data->_start_node, false );
+			chunk_node->setLowerUpper( chunk_lower, chunk_upper );
+			chunk_node->setIterCount( chunk_iters );
+			chunk_node->setLoopCounter( loop->getId() );
+			chunk_node->setThreadId( task_data->_threadNum );
+			chunk_node->setSiteId( loop->getSiteId() );
+			chunk_node->addChunkTime( loop_time * chunk_iters / thread_iters );
+			chunk_node->initPapiVals( libtdg::g_papiNumEvents );
+			Graph::connectNodes( chunk_node, ws_data->_sink_node );
+		}
+	}
+	
+	
+	// The node that continues a task after a region or a loop. The continuations of the initial 
+	// task are serial code, like its first node.
+	Node::NodeType continuation_type( TaskData* task_data )
+	{
+		return (task_data->_curr_task_node->getType() == Node::ROOT_TASK) ? Node::ROOT_TASK : Node::IMP_TASK;
+	}
+	
+	// A task is referenced by the runtime until it completes, by its parent until the parent joins it,
+	// and by the dependence table of its parent and the predecessor lists of its siblings. The last
+	// reference frees it, its node is final by then.
+	void acquire_task( TaskData* task_data )
+	{
+		task_data->_refs.fetch_add( 1, std::memory_order_relaxed );
+	}
+	
+	void release_task( TaskData* task_data );
+	
+	void add_dependence( TaskData* src_task, TaskData* sink_task )
+	{
+		if( src_task && src_task != sink_task )
+		{
+			acquire_task( src_task );
+			sink_task->_dep_preds.push_back( src_task );
+		}
+	}
+	
+	// The predecessors have completed by the time a dependent task starts, so their 
+	// current nodes are their final nodes
+	void connect_dependences( TaskData* task_data )
+	{
+		for( std::vector<TaskData*>::iterator it = task_data->_dep_preds.begin(); it != task_data->_dep_preds.end(); ++it )
+		{
+			Graph::connectNodes( (*it)->_curr_task_node, task_data->_curr_task_node );
+			release_task( *it );
+		}
+		std::vector<TaskData*>().swap( task_data->_dep_preds );
+	}
+	
+	void release_dependences( TaskData* task_data )
+	{
+		DependenceTable* dep_table = task_data->_dep_table;
+		if( !dep_table )
+			return;
+		task_data->_dep_table = NULL;
+		for( DependenceTable::iterator it = dep_table->begin(); it != dep_table->end(); ++it )
+		{
+			if( it->second._last_writer )
+				release_task( it->second._last_writer );
+			for( std::vector<TaskData*>::iterator reader = it->second._readers.begin(); 
+				 reader != it->second._readers.end(); ++reader )
+				release_task( *reader );
+		}
+		delete dep_table;
+	}
+	
+	void release_children( TaskData* task_data )
+	{
+		std::vector<TaskData*> children;
+		children.swap( task_data->_children );
+		for( std::vector<TaskData*>::iterator it = children.begin(); it != children.end(); ++it )
+			release_task( *it );
+	}
+	
+	void release_task( TaskData* task_data )
+	{
+		if( task_data->_refs.fetch_sub( 1, std::memory_order_acq_rel ) != 1 )
+			return;
+		release_children( task_data );
+		release_dependences( task_data );
+		for( std::vector<TaskData*>::iterator it = task_data->_dep_preds.begin(); it != task_data->_dep_preds.end(); ++it )
+			release_task( *it );
+		delete task_data;
+	}
+	
+	// Connects the final nodes of the completed children created from first_seq on (and for 
+	// taskgroups, of their descendants that are not joined yet) to the taskwait node
+	void join_children( TaskData* task_data, Node* taskwait_node, uint64_t first_seq, bool descendants )
+	{
+		std::vector<TaskData*>& children = task_data->_children;
+		unsigned int num_pending = 0;
+		for( unsigned int i = 0; i < children.size(); ++i )
+		{
+			TaskData* child = children[i];
+			if( child->_create_seq >= first_seq && child->_completed.load( std::memory_order_acquire ) )
+			{
+				Graph::connectNodes( child->_curr_task_node, taskwait_node );
+				if( descendants )
+					join_children( child, taskwait_node, 0, true );
+				release_task( child );
+			}
+			else
+			{
+				children[num_pending++] = child;
+			}
+		}
+		children.resize( num_pending );
+	}
+	
+	// Taskwait and taskgroup split the current node of the task into the node before the 
+	// construct and the node after it, the two are joined through a taskwait node
+	void begin_task_sync( TaskData* task_data, const void* codeptr_ra )
+	{
+		double curr_time = ftimer_msec();
+		task_data->_in_sync = true;
+		if( !task_data->_detailed )
+		{
+			pause_task( task_data, curr_time );
+			return;
+		}
+		task_data->_sync_node_type = task_data->_curr_task_node->getType();
+		task_data->_curr_task_node->addTime( curr_time );
+		pause_task( task_data, curr_time );
+		task_data->_curr_task_node = create_new_node( Node::TASKWAIT, task_data->_curr_task_node, false );
+		task_data->_curr_task_node->setSiteId( intern_site( codeptr_ra ) );
+	}
+	
+	// A taskwait joins all the completed children, a taskgroup the tasks created in it and their descendants
+	void end_task_sync( TaskData* task_data, uint64_t first_seq, bool descendants )
+	{
+		if( !task_data->_detailed )
+		{
+			task_data->_in_sync = false;
+			resume_task( task_data, ftimer_msec() );
+			return;
+		}
+		Node* taskwait_node = task_data->_curr_task_node;
+		join_children( task_data, taskwait_node, first_seq, descendants );
+		task_data->_curr_task_node = create_new_node( task_data->_sync_node_type, taskwait_node );
+		task_data->_curr_task_node->setSiteId( task_data->_site_id );
+		set_serial_node( task_data->_curr_task_node );
+		task_data->_in_sync = false;
+		resume_task( task_data, ftimer_msec() );
+		
+		// Without unfinished children the dependence table can no longer affect new tasks
+		if( task_data->_children.empty() )
+			release_dependences( task_data );
+	}
+	
 	
 	/*======================== Callback funcs ========================*/
 
@@ -158,14 +969,13 @@ namespace libtdg
 		ompt_data_t *thread_data          /* data of thread               */
 	)
 	{
+		SelfTimer self_timer( TOOL_CB_THREAD_BEGIN );
 #ifdef LIBTDG_TRACE
 		TRACE_CALLBACK1("thread begin","type",thread_type);
 #endif
 	
 		ThreadData* th_data = new ThreadData;
 	
-		th_data->_loopCounter = 0;
-	
 #ifdef HAVE_PAPI
 		th_data->_papiEventset = PAPI_NULL;
 	
@@ -186,13 +996,20 @@ namespace libtdg
 #endif
 		
 		thread_data->ptr = th_data;
-
+		
+		if( g_monitor )
+		{
+			uint32_t monitor_idx = g_monitor->_numThreads.fetch_add( 1 );
+			if( monitor_idx < MONITOR_MAX_THREADS )
+				t_monitorThread = &g_monitor->_threads[monitor_idx];
+		}
 	}
 
 	void cb_thread_end (
 		ompt_data_t *thread_data          /* data of thread               */
 	)
 	{
+		SelfTimer self_timer( TOOL_CB_THREAD_END );
 #ifdef LIBTDG_TRACE
 		TRACE_CALLBACK("thread end");
 #endif
@@ -223,25 +1040,54 @@ namespace libtdg
 		unsigned int thread_num
 	)
 	{
+		SelfTimer self_timer( TOOL_CB_IMPLICIT_TASK );
 #ifdef LIBTDG_TRACE
 		TRACE_CALLBACK4("implicit task","endpoint",endpoint,"team size",team_size,"thread",thread_num,"task_data",task_data);
 #endif
 		
+		if( endpoint == ompt_scope_begin && !parallel_data->ptr )
+		{
+			task_data->ptr = NULL;
+			return;
+		}
+		if( endpoint == ompt_scope_end && !task_data->ptr )
+			return;
+		
 		if( endpoint == ompt_scope_begin )
 		{
 			ParallelRegionData* par_info = (ParallelRegionData*)parallel_data->ptr;
 			TaskData* new_task_data = new TaskData;
-			new_task_data->_curr_task_node = 
-				create_new_node( Node::IMP_TASK, par_info->_parent_task_data->_curr_task_node );
+			new_task_data->_detailed = par_info->_detailed;
+			if( new_task_data->_detailed )
+			{
+				new_task_data->_curr_task_node = 
+					create_new_node( Node::IMP_TASK, par_info->_parent_task_data->_curr_task_node );
+				new_task_data->_curr_task_node->setSiteId( par_info->_site_id );
+			}
+			new_task_data->_site_id = par_info->_site_id;
 			new_task_data->_sink_node = par_info->_sink_node;
 			new_task_data->_threadNum = thread_num;
+			new_task_data->_teamSize = team_size;
+			new_task_data->_region_stats = par_info->_stats;
 			task_data->ptr = new_task_data;
+			
+			par_info->_stats->_mutex.lock();
+			par_info->_stats->_refs++;
+			par_info->_stats->_num_threads++;
+			par_info->_stats->_mutex.unlock();
+			resume_task( new_task_data, ftimer_msec() );
 		}
 		
 		if( endpoint == ompt_scope_end )
 		{
 			TaskData* curr_task_data = (TaskData*)task_data->ptr;
-			if( curr_task_data->_curr_barrier_node )
+			release_dependences( curr_task_data );
+			pause_task( curr_task_data, ftimer_msec() );
+			if( !curr_task_data->_detailed )
+			{
+				// No nodes
+			}
+			else if( curr_task_data->_curr_barrier_node )
 			{
 				Graph::disconnectNodes( curr_task_data->_curr_barrier_node, curr_task_data->_curr_task_node );
 				g_tdg->removeNode( curr_task_data->_curr_task_node->getId() );
@@ -257,7 +1103,9 @@ namespace libtdg
 				curr_task_data->_curr_task_node->addTime( ftimer_msec() );
 				Graph::connectNodes( curr_task_data->_curr_task_node, curr_task_data->_sink_node );
 			}
-			delete curr_task_data;
+			// The nodes of the task are final, the instance may be folded
+			release_region_stats( curr_task_data->_region_stats, curr_task_data->_busy_time, 0.0 );
+			release_task( curr_task_data );
 			task_data->ptr = NULL;
 		}
 	}
@@ -271,15 +1119,80 @@ namespace libtdg
 		const void *codeptr_ra
 	)
 	{
+		SelfTimer self_timer( TOOL_CB_PARALLEL_BEGIN );
 #ifdef LIBTDG_TRACE
 		TRACE_CALLBACK2("parallel begin","parent",parent_task_data->value,"team size",requested_team_size);
 #endif
 		
+		// While capture is paused no captured region runs, since start and pause only take effect at
+		// the next top-level region, so the region is only counted for the capture window
+		TaskData* parent_task = (TaskData*)parent_task_data->ptr;
+		if( !g_captureOn.load( std::memory_order_relaxed ) && !g_capturing )
+		{
+			if( parent_task )
+				g_numTopRegions++;
+			parallel_data->ptr = NULL;
+			return;
+		}
+		
+		// Regions nested in tasks that are not tracked, top-level regions that are not captured and
+		// regions outside the site filter are not tracked. The time of a region outside the filter
+		// stays in the node of the master.
+		bool selected;
+		uint32_t site_id = intern_site( codeptr_ra, &selected );
+		double curr_time = ftimer_msec();
+		if( !parent_task || (!parent_task->_region_stats && !capture_region( parent_task, curr_time )) || !selected )
+		{
+			parallel_data->ptr = NULL;
+			return;
+		}
+		if( !parent_task->_region_stats )
+			g_inTopRegion = true;
+		
 		ParallelRegionData* par_info = new ParallelRegionData;
 		par_info->_parent_task_data = (TaskData*)parent_task_data->ptr;
-		par_info->_parent_task_data->_curr_task_node->addTime( ftimer_msec() );
-		par_info->_sink_node = create_clean_node( Node::IMP_TASK, true );
 		par_info->_team_size = requested_team_size;
+		par_info->_site_id = site_id;
+		par_info->_stats = new RegionStats( par_info->_site_id );
+		if( g_snapshots && !parent_task->_region_stats )
+			open_snapshot_region( par_info->_stats );
+		par_info->_start_time = curr_time;
+		pause_task( par_info->_parent_task_data, curr_time );
+		
+		// Nested regions are sampled with their top-level region
+		RegionStats* parent_stats = par_info->_parent_task_data->_region_stats;
+		par_info->_detailed = parent_stats ? par_info->_parent_task_data->_detailed : sample_region( par_info->_site_id );
+		if( par_info->_detailed )
+		{
+			par_info->_parent_task_data->_curr_task_node->addTime( curr_time );
+			// The sink is the continuation of the encountering task after the region
+			par_info->_sink_node = create_clean_node( continuation_type( par_info->_parent_task_data ), true );
+			par_info->_sink_node->setSiteId( par_info->_parent_task_data->_site_id );
+		}
+		
+		if( parent_stats )
+		{
+			parent_stats->_mutex.lock();
+			parent_stats->_refs++;
+			parent_stats->_mutex.unlock();
+			par_info->_stats->_parent = parent_stats;
+		}
+		else
+		{
+			par_info->_stats->_top_level = true;
+			g_topRegionsInFlight.fetch_add( 1 );
+		}
+		
+		if( !parent_stats && par_info->_detailed && (g_useTemplates || g_sampleRate > 0.0 || g_monitor || g_regionFinalize) )
+		{
+			Node* entry_node = par_info->_parent_task_data->_curr_task_node;
+			entry_node->getExitsMutex().lock();
+			par_info->_stats->_entry_exits = entry_node->getExits().size();
+			entry_node->getExitsMutex().unlock();
+			par_info->_stats->_entry_node = entry_node;
+			par_info->_stats->_sink_node = par_info->_sink_node;
+			par_info->_stats->_first_loop = g_tdg->getNumLoops();
+		}
 		
 		parallel_data->ptr = par_info;
 	}
@@ -291,14 +1204,31 @@ namespace libtdg
 		const void *codeptr_ra             
 	)
 	{
+		SelfTimer self_timer( TOOL_CB_PARALLEL_END );
 #ifdef LIBTDG_TRACE
 		TRACE_CALLBACK1("parallel end","parallel data",parallel_data->ptr);
 #endif
 
+		double curr_time = ftimer_msec();
 		ParallelRegionData* par_info = (ParallelRegionData*)parallel_data->ptr;
-		par_info->_parent_task_data->_curr_task_node = par_info->_sink_node;
-		par_info->_sink_node->setLastTime( ftimer_msec() );
-		g_finalNode = par_info->_sink_node;
+		if( !par_info )
+			return;
+		if( par_info->_detailed )
+		{
+			par_info->_parent_task_data->_curr_task_node = par_info->_sink_node;
+			par_info->_sink_node->setLastTime( curr_time );
+			g_finalNode = par_info->_sink_node;
+			set_serial_node( par_info->_sink_node );
+		}
+		else if( par_info->_parent_task_data->_detailed )
+		{
+			// The time of the region is not part of the node of the parent
+			par_info->_parent_task_data->_curr_task_node->setLastTime( curr_time );
+		}
+		resume_task( par_info->_parent_task_data, curr_time );
+		if( par_info->_stats->_top_level )
+			g_inTopRegion = false;
+		release_region_stats( par_info->_stats, 0.0, curr_time - par_info->_start_time );
 		
 		delete par_info;
 		parallel_data->ptr = NULL;		
@@ -313,6 +1243,7 @@ namespace libtdg
 		const void *codeptr_ra
 	)
 	{
+		SelfTimer self_timer( TOOL_CB_TASK_CREATE );
 #ifdef LIBTDG_TRACE
 		TRACE_CALLBACK4("task create","type",type,"parent_task_data",(parent_task_data ? parent_task_data->ptr : 0),"new_task_data",new_task_data,"has_dependences",has_dependences);
 #endif
@@ -321,15 +1252,33 @@ namespace libtdg
 		{
 			TaskData* task_data = new TaskData;
 			task_data->_curr_task_node = create_new_node( Node::ROOT_TASK, NULL );
+			resume_task( task_data, ftimer_msec() );
 			new_task_data->ptr = task_data;
 			g_finalNode = task_data->_curr_task_node;
 		}
-		if( type == ompt_task_explicit )
+		// Below the tasks level explicit tasks are not tracked, their time stays in the encountering task.
+		// Neither are the tasks of untracked tasks and the tasks of sequential code while capture is paused.
+		TaskData* parent_task = parent_task_data ? (TaskData*)parent_task_data->ptr : NULL;
+		if( type == ompt_task_explicit && 
+			(g_level < LEVEL_TASKS || !parent_task || (!parent_task->_region_stats && !g_capturing)) )
+		{
+			new_task_data->ptr = NULL;
+		}
+		else if( type == ompt_task_explicit )
 		{
-			TaskData* parent_task = (TaskData*)parent_task_data->ptr;
 			TaskData* task_data = new TaskData;
-			task_data->_curr_task_node = 
-				create_new_node( Node::EXP_TASK, parent_task ? parent_task->_curr_task_node : NULL );
+			task_data->_site_id = intern_site( codeptr_ra );
+			task_data->_parent_task = parent_task;
+			task_data->_detailed = parent_task->_detailed;
+			task_data->_region_stats = parent_task->_region_stats;
+			if( task_data->_detailed )
+			{
+				task_data->_curr_task_node = create_new_node( Node::EXP_TASK, parent_task->_curr_task_node );
+				task_data->_curr_task_node->setSiteId( task_data->_site_id );
+				task_data->_create_seq = parent_task->_num_created++;
+				acquire_task( task_data );
+				parent_task->_children.push_back( task_data );
+			}
 			new_task_data->ptr = task_data;
 		}
 	}
@@ -340,6 +1289,7 @@ namespace libtdg
 		ompt_task_data_t *second_task_data
 	)
 	{
+		SelfTimer self_timer( TOOL_CB_TASK_SCHEDULE );
 #ifdef LIBTDG_TRACE
 		TRACE_CALLBACK3("task schedule","first_task_data",first_task_data,"prior_task_status",prior_task_status,"second_task_data",second_task_data);
 #endif
@@ -347,10 +1297,35 @@ namespace libtdg
 		TaskData* first_task = (TaskData*)first_task_data->ptr;
 		TaskData* second_task = (TaskData*)second_task_data->ptr;
 		
+		double curr_time = ftimer_msec();
 		if( first_task )
-			first_task->_curr_task_node->addTime( ftimer_msec() );
+		{
+			// The time a task waits in a taskwait or a barrier is not part of its work
+			if( !first_task->_in_sync )
+			{
+				if( first_task->_detailed )
+					first_task->_curr_task_node->addTime( curr_time );
+				pause_task( first_task, curr_time );
+			}
+			if( prior_task_status == ompt_task_complete )
+			{
+				first_task->_completed.store( true, std::memory_order_release );
+				release_dependences( first_task );
+				record_site_instance( first_task->_site_id, SiteStats::TASK_SITE, first_task->_busy_time, 
+									  first_task->_busy_time, 0.0 );
+				add_region_work( first_task->_region_stats, first_task->_busy_time );
+				release_task( first_task );
+			}
+		}
 		if( second_task )
-			second_task->_curr_task_node->setLastTime( ftimer_msec() );
+		{
+			if( !second_task->_dep_preds.empty() )
+				connect_dependences( second_task );
+			if( second_task->_detailed )
+				second_task->_curr_task_node->setLastTime( curr_time );
+			if( !second_task->_in_sync )
+				resume_task( second_task, curr_time );
+		}
 	}
 	
 	void cb_task_dependences (
@@ -359,6 +1334,45 @@ namespace libtdg
 		int ndeps
 	)
 	{
+		SelfTimer self_timer( TOOL_CB_TASK_DEPENDENCES );
+#ifdef LIBTDG_TRACE
+		TRACE_CALLBACK2("task dependences","task_data",task_data->ptr,"ndeps",ndeps);
+#endif
+
+		TaskData* new_task = (TaskData*)task_data->ptr;
+		if( !new_task || !new_task->_parent_task || !new_task->_detailed )
+			return;
+		
+		TaskData* parent_task = new_task->_parent_task;
+		if( !parent_task->_dep_table )
+		{
+			parent_task->_dep_table = new DependenceTable;
+			parent_task->_dep_first_seq = new_task->_create_seq;
+		}
+		
+		for( int i = 0; i < ndeps; ++i )
+		{
+			DependenceEntry& entry = (*parent_task->_dep_table)[deps[i].variable_addr];
+			add_dependence( entry._last_writer, new_task );
+			
+			acquire_task( new_task );
+			if( deps[i].dependence_flags & ompt_task_dependence_type_out )	// out and inout
+			{
+				for( std::vector<TaskData*>::iterator it = entry._readers.begin(); it != entry._readers.end(); ++it )
+				{
+					add_dependence( *it, new_task );
+					release_task( *it );
+				}
+				entry._readers.clear();
+				if( entry._last_writer )
+					release_task( entry._last_writer );
+				entry._last_writer = new_task;
+			}
+			else
+			{
+				entry._readers.push_back( new_task );
+			}
+		}
 	}
 
 	void cb_task_dependence (
@@ -366,6 +1380,14 @@ namespace libtdg
 		ompt_data_t *sink_task_data
 	)
 	{
+		SelfTimer self_timer( TOOL_CB_TASK_DEPENDENCE );
+#ifdef LIBTDG_TRACE
+		TRACE_CALLBACK2("task dependence","src",src_task_data->ptr,"sink",sink_task_data->ptr);
+#endif
+
+		TaskData* sink_task = (TaskData*)sink_task_data->ptr;
+		if( sink_task && sink_task->_detailed )
+			add_dependence( (TaskData*)src_task_data->ptr, sink_task );
 	}
 	
 	void cb_work (
@@ -377,6 +1399,7 @@ namespace libtdg
 		const void *codeptr_ra
 	)
 	{
+		SelfTimer self_timer( TOOL_CB_WORK );
 #ifdef LIBTDG_TRACE
 		TRACE_CALLBACK3("worksharing","type",wstype,"endpoint",endpoint,"par data",parallel_data->ptr);
 #endif
@@ -390,18 +1413,56 @@ namespace libtdg
 		const void *codeptr_ra
 	)
 	{
+		SelfTimer self_timer( TOOL_CB_SYNC_REGION );
 #ifdef LIBTDG_TRACE
 		TRACE_CALLBACK3("sync region","kind",kind,"endpoint",endpoint,"task data",task_data->ptr);
 #endif
 
 		TaskData* curr_task_data = (TaskData*)task_data->ptr;
 		ParallelRegionData* par_info = (ParallelRegionData*)parallel_data->ptr;
+		if( !curr_task_data )
+			return;
+		
+		if( kind == ompt_sync_region_taskwait )
+		{
+			if( endpoint == ompt_scope_begin )
+				begin_task_sync( curr_task_data, codeptr_ra );
+			else
+				end_task_sync( curr_task_data, 0, false );
+		}
+		
+		// The taskgroup region spans the whole construct, the tasks created from its begin on
+		// are the tasks of the group. Its wait is reported by cb_sync_region_wait; when the 
+		// runtime does not report it, the wait stays in the time of the task.
+		if( kind == ompt_sync_region_taskgroup )
+		{
+			if( endpoint == ompt_scope_begin )
+			{
+				curr_task_data->_taskgroup_marks.push_back( curr_task_data->_num_created );
+			}
+			else if( !curr_task_data->_taskgroup_marks.empty() )
+			{
+				uint64_t first_seq = curr_task_data->_taskgroup_marks.back();
+				curr_task_data->_taskgroup_marks.pop_back();
+				if( !curr_task_data->_in_sync )
+					begin_task_sync( curr_task_data, codeptr_ra );
+				end_task_sync( curr_task_data, first_seq, true );
+				
+				// When all the children in the dependence table were created in the group, their
+				// dependences can no longer affect new tasks
+				if( curr_task_data->_dep_table && curr_task_data->_dep_first_seq >= first_seq )
+					release_dependences( curr_task_data );
+			}
+		}
 		
 		if( endpoint == ompt_scope_begin )
 		{
 			if( kind == ompt_sync_region_barrier )
 			{
-				if( par_info && par_info->_team_size > 1 )
+				pause_task( curr_task_data, ftimer_msec() );
+				curr_task_data->_in_sync = true;
+				
+				if( par_info && par_info->_team_size > 1 && curr_task_data->_detailed )
 				{
 					curr_task_data->_curr_task_node->addTime( ftimer_msec() );
 					Node* barrier_node = NULL;
@@ -410,6 +1471,7 @@ namespace libtdg
 					if( par_info->_barrier_cnt++ == 0 )		// first one to reach the barrier end
 					{
 						barrier_node = create_new_node( Node::BARRIER, curr_task_data->_curr_task_node );
+						barrier_node->setSiteId( intern_site( codeptr_ra ) );
 						new_barrier = true;
 						par_info->_curr_barrier_node = barrier_node;
 					}
@@ -428,6 +1490,7 @@ namespace libtdg
 					
 					
 					curr_task_data->_curr_task_node = create_new_node( Node::IMP_TASK, barrier_node );
+					curr_task_data->_curr_task_node->setSiteId( curr_task_data->_site_id );
 					// If we want to measure the time each thread spent in the barrier we should add
 					// here: curr_task_data->_curr_task_node->setLastTime( ftimer_msec() );
 					// Otherwise, this line appears in the end of the barrier (endpoint == ompt_scope_end)
@@ -443,14 +1506,51 @@ namespace libtdg
 		{
 			if( kind == ompt_sync_region_barrier )
 			{
-				if( par_info && par_info->_team_size > 1 )
+				double curr_time = ftimer_msec();
+				if( par_info && par_info->_team_size > 1 && curr_task_data->_detailed )
+				{
+					curr_task_data->_curr_task_node->setLastTime( curr_time );	
+				}
+				curr_task_data->_in_sync = false;
+				resume_task( curr_task_data, curr_time );
+
+				// The barrier completes all the tasks of the team, the children that are not joined yet
+				// and their descendants are joined into it and nothing else can join them
+				if( par_info && par_info->_team_size > 1 && curr_task_data->_detailed &&
+					!curr_task_data->_children.empty() )
 				{
-					curr_task_data->_curr_task_node->setLastTime( ftimer_msec() );	
+					par_info->_barrier_mutex.lock();
+					join_children( curr_task_data, curr_task_data->_curr_barrier_node, 0, true );
+					par_info->_barrier_mutex.unlock();
 				}
+				release_children( curr_task_data );
+				release_dependences( curr_task_data );
 			}
 		}
 	}
 	
+	void cb_sync_region_wait (
+		ompt_sync_region_kind_t kind,
+		ompt_scope_endpoint_t endpoint,
+		ompt_data_t *parallel_data,
+		ompt_data_t *task_data,
+		const void *codeptr_ra
+	)
+	{
+		SelfTimer self_timer( TOOL_CB_SYNC_REGION_WAIT );
+#ifdef LIBTDG_TRACE
+		TRACE_CALLBACK3("sync region wait","kind",kind,"endpoint",endpoint,"task data",task_data->ptr);
+#endif
+		
+		// Only the wait of a taskgroup is not a sync region of its own, it ends with the taskgroup
+		TaskData* curr_task_data = (TaskData*)task_data->ptr;
+		if( curr_task_data && kind == ompt_sync_region_taskgroup && endpoint == ompt_scope_begin &&
+			!curr_task_data->_taskgroup_marks.empty() && !curr_task_data->_in_sync )
+		{
+			begin_task_sync( curr_task_data, codeptr_ra );
+		}
+	}
+	
 	void cb_ext_loop (
 		ext_loop_sched_t loop_sched,
 		ompt_scope_endpoint_t endpoint,
@@ -464,53 +1564,113 @@ namespace libtdg
 		const void * codeptr_ra
 	)
 	{
+		SelfTimer self_timer( TOOL_CB_EXT_LOOP );
 #ifdef LIBTDG_TRACE
 		TRACE_CALLBACK4("loop","lower",lower,"upper",upper,"chunk_size",chunk_size,"codeptr_ra",codeptr_ra);
 #endif
 		
-		// codeptr_ra contains a code address that can be translated to source code filname and line
-		// number with the 'addr2line' command
-		// Use libunwind to get more precise address:
-		// http://eli.thegreenplace.net/2015/programmatic-access-to-the-call-stack-in-c/
-		
 		TaskData* curr_task_data = (TaskData*)task_data->ptr;
+		if( !curr_task_data )
+			return;
+		
+		// Loops outside the site filter have no worksharing data, their time stays in the node of the task
+		if( endpoint == ompt_scope_begin )
+		{
+			bool selected;
+			intern_site( codeptr_ra, &selected );
+			if( !selected )
+			{
+				curr_task_data->_curr_ws_data = NULL;
+				return;
+			}
+		}
+		else if( !curr_task_data->_curr_ws_data )
+		{
+			return;
+		}
+		
 		ompt_data_t* thread_data = (ompt_data_t*)g_get_thread_data_f();
 		ThreadData* th_data = (ThreadData*)thread_data->ptr;
 		
+		// Loops of region instances that are not sampled only contribute to the loop-site statistics
+		if( !curr_task_data->_detailed )
+		{
+			if( endpoint == ompt_scope_begin )
+			{
+				WorksharingData* ws_data = new WorksharingData;
+				ws_data->_loop = get_team_loop( (ParallelRegionData*)parallel_data->ptr, curr_task_data, loop_sched,
+												lower, upper, step, chunk_size, codeptr_ra );
+				ws_data->_loop_index = curr_task_data->_loopIndex - 1;
+				ws_data->_start_time = ftimer_msec();
+				curr_task_data->_curr_ws_data = ws_data;
+			}
+			else
+			{
+				finish_loop_span( (ParallelRegionData*)parallel_data->ptr, curr_task_data->_curr_ws_data, ftimer_msec() );
+				delete curr_task_data->_curr_ws_data;
+				curr_task_data->_curr_ws_data = NULL;
+			}
+			return;
+		}
+		
 		if( endpoint == ompt_scope_begin )
 		{
 			curr_task_data->_curr_task_node->addTime( ftimer_msec() );
 			
 			WorksharingData* ws_data = new WorksharingData;
-			ws_data->_start_node = create_new_node( Node::WS_TASK, curr_task_data->_curr_task_node );
+			ws_data->_start_node = create_new_node( Node::WS_TASK, curr_task_data->_curr_task_node, false );
 			ws_data->_start_node->setLowerUpper( lower, upper );
-			ws_data->_sink_node = create_clean_node( Node::IMP_TASK, true );
+			ws_data->_sink_node = create_clean_node( continuation_type( curr_task_data ), true );
+			ws_data->_loop = get_team_loop( (ParallelRegionData*)parallel_data->ptr, curr_task_data, loop_sched,
+											lower, upper, step, chunk_size, codeptr_ra );
+			ws_data->_loop_index = curr_task_data->_loopIndex - 1;
+			ws_data->_thread_lower = thread_lower;
+			ws_data->_start_node->setSiteId( ws_data->_loop->getSiteId() );
+			ws_data->_sink_node->setSiteId( curr_task_data->_site_id );
+			if( g_overheadBudget > 0.0 )
+				set_capture_level( ws_data, ws_data->_loop->getSiteId() );
 			
 			curr_task_data->_curr_ws_data = ws_data;
+			
+			// In static loops the counters of the whole thread share are kept in the start node
+			if( loop_sched == ext_loop_sched_static )
+			{
+				ws_data->_start_node->initPapiVals( libtdg::g_papiNumEvents );
+				ws_data->_start_node->startPapiCounters( th_data->_papiEventset );
+			}
+			ws_data->_start_time = ftimer_msec();
+			ws_data->_start_node->setLastTime( ws_data->_start_time );
 		}
 		
 		if( endpoint == ompt_scope_end )
 		{
+			double end_time = ftimer_msec();
 			Node* last_chunk_node = curr_task_data->_curr_ws_data->_last_chunk_node;
 			if( last_chunk_node )
 			{
 				last_chunk_node->endPapiCounters( th_data->_papiEventset );
-				last_chunk_node->addTime( ftimer_msec() );
+				last_chunk_node->endChunk( end_time );
+			}
+			else if( curr_task_data->_curr_ws_data->_loop->getSched() == ext_loop_sched_static )
+			{
+				curr_task_data->_curr_ws_data->_start_node->endPapiCounters( th_data->_papiEventset );
+				create_static_chunks( curr_task_data, end_time - curr_task_data->_curr_ws_data->_start_time );
 			}
 			else
 			{
-				curr_task_data->_curr_ws_data->_start_node->addTime( ftimer_msec() );
+				curr_task_data->_curr_ws_data->_start_node->addTime( end_time );
 				Graph::connectNodes( curr_task_data->_curr_ws_data->_start_node, 
 									 curr_task_data->_curr_ws_data->_sink_node );
 			}
+			finish_loop_span( (ParallelRegionData*)parallel_data->ptr, curr_task_data->_curr_ws_data, end_time );
+			if( g_overheadBudget > 0.0 && curr_task_data->_curr_ws_data->_num_chunks )
+				govern_loop_site( curr_task_data->_curr_ws_data, end_time - curr_task_data->_curr_ws_data->_start_time );
 			curr_task_data->_curr_task_node = curr_task_data->_curr_ws_data->_sink_node;
 			curr_task_data->_curr_task_node->setLastTime( ftimer_msec() );
+			set_serial_node( curr_task_data->_curr_task_node );
 			
 			delete curr_task_data->_curr_ws_data;
 			curr_task_data->_curr_ws_data = NULL;
-			
-			++th_data->_loopCounter;	// Each thread increases the loop counter independently,
-										// so the value should be the same for each thread
 		}
 	}
 	
@@ -521,39 +1681,92 @@ namespace libtdg
 		int last_chunk                  /* Is scheduled chunk last for thread? */
 	)
 	{
+		SelfTimer self_timer( TOOL_CB_EXT_CHUNK );
 #ifdef LIBTDG_TRACE
 		TRACE_CALLBACK4("chunk","lower",lower,"upper",upper,"task data",task_data->ptr,"last",last_chunk);
 #endif
 
 		TaskData* curr_task_data = (TaskData*)task_data->ptr;
+		if( !curr_task_data || !curr_task_data->_detailed )
+			return;
+		
+		WorksharingData* ws_data = curr_task_data->_curr_ws_data;
+		if( !ws_data )
+			return;
+		
+		Node* last_chunk_node = ws_data->_last_chunk_node;
+		
+		// In aggregate capture the first chunk node of the thread counts all the chunks, without PAPI
+		// counters or tool time. The clock is read once per chunk to keep the longest chunk, which is
+		// the time of the node on a path.
+		if( ws_data->_level == CAPTURE_AGGREGATE && last_chunk_node )
+		{
+			if( !last_chunk )
+			{
+				last_chunk_node->endChunk( ftimer_msec() );
+				int64_t step = ws_data->_loop->getStep();
+				last_chunk_node->coalesceChunk( lower, upper, std::abs( upper - lower ) / std::max( (int64_t)1, std::abs( step ) ) + 1 );
+				if( t_monitorThread )
+					monitor_add( t_monitorThread->_chunks, 1 );
+			}
+			return;
+		}
+		
+		// The runtime calls back once it has the next chunk, so its dispatch time stays in the previous
+		// chunk; only the time of the tool between the end of the previous chunk and the start of the
+		// new one can be measured
+		double end_time = ftimer_msec();
+		
 		ompt_data_t* thread_data = (ompt_data_t*)g_get_thread_data_f();
 		ThreadData* th_data = (ThreadData*)thread_data->ptr;
-        
-        if( curr_task_data->_curr_ws_data->_last_chunk_node ) 
+		
+        if( last_chunk_node ) 
         {
 			if( !last_chunk )
 			{
-				Node* last_chunk_node = curr_task_data->_curr_ws_data->_last_chunk_node;
 				last_chunk_node->endPapiCounters( th_data->_papiEventset );
-				last_chunk_node->addTime( ftimer_msec() );
+				last_chunk_node->endChunk( end_time );
 			}
 		}
 		else
 		{
-			curr_task_data->_curr_ws_data->_start_node->addTime( ftimer_msec() );
+			curr_task_data->_curr_ws_data->_start_node->addTime( end_time );
 		}
 		
 		if( !last_chunk )
 		{
-			Node* chunk_node = create_new_node( Node::CHUNK_TASK, curr_task_data->_curr_ws_data->_start_node );
+			int64_t step = curr_task_data->_curr_ws_data->_loop->getStep();
+			int64_t chunk_iters = std::abs( upper - lower ) / std::max( (int64_t)1, std::abs( step ) ) + 1;
+			
+			// A short chunk node of the thread absorbs the next chunk
+			if( last_chunk_node && last_chunk_node->getTotalTime() < ws_data->_coalesce_time )
+			{
+				last_chunk_node->coalesceChunk( lower, upper, chunk_iters );
+				
+				double start_time = ftimer_msec();
+				last_chunk_node->setLastTime( start_time );
+				last_chunk_node->addToolTime( start_time - end_time );
+				last_chunk_node->startPapiCounters( th_data->_papiEventset );
+				count_chunk( ws_data, start_time - end_time );
+				return;
+			}
+			
+			Node* chunk_node = create_new_node( Node::CHUNK_TASK, curr_task_data->_curr_ws_data->_start_node, false );
 			chunk_node->setLowerUpper( lower, upper );
-			chunk_node->setLoopCounter( th_data->_loopCounter );
+			chunk_node->setIterCount( chunk_iters );
+			chunk_node->setLoopCounter( curr_task_data->_curr_ws_data->_loop->getId() );
 			chunk_node->setThreadId( curr_task_data->_threadNum );
+			chunk_node->setSiteId( curr_task_data->_curr_ws_data->_loop->getSiteId() );
 			curr_task_data->_curr_ws_data->_last_chunk_node = chunk_node;
 			Graph::connectNodes( chunk_node, curr_task_data->_curr_ws_data->_sink_node );
 			
 			chunk_node->initPapiVals( libtdg::g_papiNumEvents );
+			
+			double start_time = ftimer_msec();
+			chunk_node->setLastTime( start_time );
+			chunk_node->setToolTime( start_time - end_time );
 			chunk_node->startPapiCounters( th_data->_papiEventset );
+			count_chunk( ws_data, start_time - end_time );
 		}
 	}
 }
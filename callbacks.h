@@ -22,25 +22,101 @@
 #define __CALLBACKS_H__
 
 
+#include <random>
+#include <atomic>
+#include <ostream>
 #include <ompt.h>
 #include "graph.h"
 
 
 namespace libtdg
 {
+	struct MonitorSegment;
+	
+	// Callbacks registered by TDG_LEVEL, every level includes the previous ones
+	enum InstrumentationLevel
+	{
+		LEVEL_REGIONS = 0,	// Parallel regions, implicit tasks and barriers
+		LEVEL_LOOPS,		// Worksharing loops, one node per thread in dynamic loops
+		LEVEL_CHUNKS,		// Chunks of dynamic loops
+		LEVEL_TASKS,		// Explicit tasks and their dependences
+		LEVEL_FULL
+	};
+	
 	extern ompt_fns_t 				g_fns;
 	extern ompt_function_lookup_t	g_lookup;
 	
 	extern ompt_get_thread_data_t	g_get_thread_data_f;
 	
+	// A top-level region instance taken out of the graph by TDG_REGION_FINALIZE. The node that
+	// replaces it in the graph has the span of the instance as its time.
+	struct FinalizedRegion
+	{
+		Graph*			_graph;
+		double			_span;
+		uint32_t		_site_id;
+		uint64_t		_index;
+	};
+	
+	// A completed top-level region instance that is still in the graph, whose critical path is
+	// measured in the background for the estimate of the monitor
+	struct MonitoredRegion
+	{
+		Node*			_entry;
+		size_t			_first_exit;
+		Node*			_sink;
+		double			_duration;
+	};
+	
 	extern Graph*					g_tdg;
 	extern Node*					g_finalNode;
+	
+	extern double					g_coalesceTime;
+	extern bool						g_useTemplates;
+	extern double					g_sampleRate;
+	extern std::mt19937				g_sampleRng;
+	extern double					g_overheadBudget;
+	extern InstrumentationLevel		g_level;
+	
+	extern std::atomic<bool>		g_captureOn;
+	extern bool						g_capturing;
+	extern bool						g_inTopRegion;
+	extern uint64_t					g_captureFirst;
+	extern uint64_t					g_captureLast;
+	extern MonitorSegment*			g_monitor;
+	extern bool						g_snapshots;
+	extern std::atomic<int64_t>		g_snapshotWatermark;
+	extern std::atomic<int64_t>		g_serialNodeId;
+	extern bool						g_regionFinalize;
+	extern bool						g_selfProfile;
 
 #ifdef HAVE_PAPI
 	extern unsigned int				g_papiNumEvents;
 	extern int*						g_papiEvents;
 #endif
 
+	// Reports the loop sites whose capture level was lowered by the overhead governor
+	void print_governor( std::ostream& out_stream );
+	
+	// Blocks until a finalized region is queued. Returns false once stop_finalized_regions 
+	// was called and the queue is empty.
+	bool wait_finalized_region( FinalizedRegion& region );
+	// Called by the worker when it is done with the region it took
+	void done_finalized_region();
+	void stop_finalized_regions();
+	
+	// Blocks until a region to measure for the monitor is queued. Returns false once 
+	// stop_monitored_regions was called and the queue is empty.
+	bool wait_monitored_region( MonitoredRegion& region );
+	// Called by the worker when it is done with the region it took
+	void done_monitored_region();
+	void stop_monitored_regions();
+	
+	// Blocks until the stats of every top-level region instance are released (the implicit tasks
+	// of the workers may end after the parallel end) and the workers are done with the queued
+	// instances, so that the graph can be walked from sequential code
+	void wait_settled_regions();
+
 	void cb_thread_begin (
 		ompt_thread_type_t thread_type,   /* type of thread               */
 		ompt_data_t *thread_data          /* data of thread               */
@@ -116,6 +192,14 @@ namespace libtdg
 		ompt_data_t *task_data,
 		const void *codeptr_ra
 	);
+	
+	void cb_sync_region_wait (
+		ompt_sync_region_kind_t kind,
+		ompt_scope_endpoint_t endpoint,
+		ompt_data_t *parallel_data,
+		ompt_data_t *task_data,
+		const void *codeptr_ra
+	);
 
 	////////////////////////// Extensions //////////////////////////
 	
@@ -201,6 +201,19 @@ namespace libtdg
 #endif
 	}
 	
+	void cb_sync_region_wait (
+		ompt_sync_region_kind_t kind,
+		ompt_scope_endpoint_t endpoint,
+		ompt_data_t *parallel_data,
+		ompt_data_t *task_data,
+		const void *codeptr_ra
+	)
+	{
+#ifdef LIBTDG_TRACE
+		TRACE_CALLBACK3("sync region wait","kind",kind,"endpoint",endpoint,"task data",task_data->value);
+#endif
+	}
+	
 	void cb_ext_loop (
 		ext_loop_sched_t loop_sched,
 		ompt_scope_endpoint_t endpoint,
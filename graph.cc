@@ -25,12 +25,14 @@
 #include <fstream>
 #include <vector>
 #include <algorithm>
+#include <unordered_set>
 
 #ifdef HAVE_PAPI
 #include <papi.h>
 #endif
 
 #include "graph.h"
+#include "symbols.h"
 
 
 using namespace libtdg;
@@ -89,6 +91,23 @@ double Node::maxPredFinishTime( )
 			return max_finish_time;
 }
 
+void Node::coalesceChunk( int64_t lower, int64_t upper, int64_t iter_count )
+{
+	// The iteration span keeps the direction of the loop
+	if( _lower <= _upper )
+	{
+		_lower = std::min( _lower, std::min( lower, upper ) );
+		_upper = std::max( _upper, std::max( lower, upper ) );
+	}
+	else
+	{
+		_lower = std::max( _lower, std::max( lower, upper ) );
+		_upper = std::min( _upper, std::min( lower, upper ) );
+	}
+	_iterCount += iter_count;
+	_chunkCount++;
+}
+
 std::string Node::idToStr()
 {
 	std::stringstream str_stream;
@@ -96,6 +115,8 @@ std::string Node::idToStr()
 	if( _type == Node::CHUNK_TASK )
 	{
 		str_stream << _loopCounter << " [" << _lower << ", " << _upper << "]";
+		if( _chunkCount > 1 )
+			str_stream << " x" << _chunkCount;
 	}
 	else
 	{
@@ -119,7 +140,7 @@ std::string Node::papiValsToStr( const char* sep_str )
 	return str_stream.str();
 }
 
-void Node::printToStream( std::ostream& str_stream )
+void Node::printToStream( std::ostream& str_stream, const char* site_name )
 {
 	const char* sep_str = " * ";
 	
@@ -131,7 +152,12 @@ void Node::printToStream( std::ostream& str_stream )
                << papiValsToStr( sep_str )
 	//-------
 	           << "\" type=\"" << getTypeStr() << "\""
-	           << (getIsCritical() ? " shape=\"doublecircle\"" : "")
+	           << (getIsCritical() ? " shape=\"doublecircle\"" : "");
+	if( site_name )
+		str_stream << " site=\"" << site_name << "\"";
+	if( _slack >= 0.0 )
+		str_stream << " slack=\"" << _slack << "\"";
+	str_stream
                << " fillcolor=\"" << getFillColor() << "\"];" << std::endl;
 }
 
@@ -153,88 +179,1055 @@ void Node::startPapiCounters( int papi_eventset )
 }
 
 
+// The counters are accumulated, coalesced chunks start and stop them once per chunk
 void Node::endPapiCounters( int papi_eventset )
 {
-	PAPI_stop( papi_eventset, _papiValsArr );
+	std::vector<long long> vals( _numPapiEvents, 0 );
+	PAPI_stop( papi_eventset, vals.data() );
+	for( unsigned int i = 0; i < _numPapiEvents; ++i )
+		_papiValsArr[i] += vals[i];
 }
 
 #endif
 
-//========================= Graph ======================================
+//======================== SiteStats ===================================
+
+const char* SiteStats::_kindStrings[3] = {"region", "loop", "task"};
 
-void Graph::visitNode( Node* curr_node, std::list<Node*>& topo_list ) 
+
+void SiteStats::addInstance( SiteKind kind, double time, double work, double capacity )
 {
-	curr_node->setVisited( true );
+	_kind = kind;
+	_numInstances++;
+	_totalTime += time;
+	_maxTime = std::max( _maxTime, time );
+	_work += work;
+	_capacity += capacity;
+	
+	int bin = (time > SITE_HIST_MIN_TIME) ? (int)(std::log10( time / SITE_HIST_MIN_TIME ) * SITE_HIST_BINS_PER_DECADE) : 0;
+	_hist[std::min( bin, SITE_HIST_BINS - 1 )]++;
+}
 
-	Node::AdjacencyIterator adj_iter =
-			Node::AdjacencyIterator::beginAdjIter (curr_node, false);   // Iterate over exit edges
-	Node::AdjacencyIterator adj_iter_end =
-			Node::AdjacencyIterator::endAdjIter (curr_node, false);     // Iterate over exit edges
-	while (adj_iter != adj_iter_end) {
-		Node* adj_node = *adj_iter;
-		if (!adj_node->getVisited ())
-			visitNode (adj_node, topo_list);
-		++adj_iter;
+
+void SiteStats::merge( const SiteStats& other )
+{
+	if( other._numInstances == 0 )
+		return;
+	_kind = other._kind;
+	_numInstances += other._numInstances;
+	_totalTime += other._totalTime;
+	_maxTime = std::max( _maxTime, other._maxTime );
+	_work += other._work;
+	_capacity += other._capacity;
+	for( unsigned int i = 0; i < _hist.size(); ++i )
+		_hist[i] += other._hist[i];
+}
+
+
+// Returns the upper bound of the histogram bin that contains the percentile
+double SiteStats::getPercentile( double fraction ) const
+{
+	uint64_t rank = std::max( (uint64_t)1, (uint64_t)std::ceil( fraction * _numInstances ) );
+	uint64_t count = 0;
+	for( unsigned int i = 0; i < _hist.size(); ++i )
+	{
+		count += _hist[i];
+		if( count >= rank )
+			return std::min( _maxTime, SITE_HIST_MIN_TIME * std::pow( 10.0, (double)(i + 1) / SITE_HIST_BINS_PER_DECADE ) );
 	}
+	return _maxTime;
+}
+
+
+const char* CallbackStats::_names[NUM_TOOL_CALLBACKS] = { "thread_begin", "thread_end", "parallel_begin", 
+	"parallel_end", "implicit_task", "task_create", "task_schedule", "task_dependences", "task_dependence",
+	"work", "sync_region", "sync_region_wait", "ext_loop", "ext_chunk" };
+
 
-	topo_list.push_front (curr_node);
+void CallbackStats::merge( const CallbackStats& other )
+{
+	_count += other._count;
+	_total += other._total;
+	_min = std::min( _min, other._min );
+	_max = std::max( _max, other._max );
+	for( unsigned int i = 0; i < _hist.size(); ++i )
+		_hist[i] += other._hist[i];
+}
+
+
+// Returns the upper bound of the histogram bin that contains the percentile
+uint64_t CallbackStats::getPercentile( double fraction ) const
+{
+	uint64_t rank = std::max( (uint64_t)1, (uint64_t)std::ceil( fraction * _count ) );
+	uint64_t count = 0;
+	for( unsigned int i = 0; i < _hist.size(); ++i )
+	{
+		count += _hist[i];
+		if( count >= rank )
+		{
+			if( i < CALLBACK_HIST_SUB_BINS )
+				return i;
+			unsigned int exp = i / CALLBACK_HIST_SUB_BINS + 2;
+			uint64_t lower = (uint64_t)(CALLBACK_HIST_SUB_BINS + i % CALLBACK_HIST_SUB_BINS) << (exp - 3);
+			return std::min( _max, lower + ((uint64_t)1 << (exp - 3)) - 1 );
+		}
+	}
+	return _max;
 }
 
 
+//========================= Graph ======================================
+
+// Kahn's algorithm: a node is emitted after all its predecessors, so its level (the length of
+// the longest path that reaches it) is final when it is emitted. The nodes are then bucketed by
+// level, which keeps the list topologically sorted. Both passes are O(V+E) and not recursive.
 void Graph::topoSort( std::list<Node*>& topo_list )
 {
+	std::vector<Node*> ready;
+	std::unordered_map<Node*, size_t> num_entries;
+	num_entries.reserve( _graphNodes.size() );
+	
 	for( Graph::NodesIterator it = _graphNodes.begin(); it != _graphNodes.end(); ++it ) 
 	{
 		Node* curr_node = it->second;
-		if (!curr_node->getVisited ())  // Unmarked node
-			visitNode (curr_node, topo_list);
+		curr_node->setVisited( false );
+		curr_node->setLevel( 0 );
+		num_entries[curr_node] = curr_node->getEntries().size();
+		if( curr_node->getEntries().empty() )
+			ready.push_back( curr_node );
 	}
-
+	
+	std::vector<Node*> order;
+	order.reserve( _graphNodes.size() );
 	int max_level = -1;
-	for( std::list<Node*>::iterator l_iter = topo_list.begin (); l_iter != topo_list.end (); l_iter++ ) 
+	for( size_t i = 0; i < ready.size(); ++i )
 	{
-		Node* curr_node = *l_iter;
-
-		int max_curr_level = 0;
+		Node* curr_node = ready[i];
+		curr_node->setVisited( true );
+		order.push_back( curr_node );
+		max_level = std::max( max_level, curr_node->getLevel() );
+		
 		Node::AdjacencyIterator adj_iter =
-				Node::AdjacencyIterator::beginAdjIter( curr_node, true );    // Iterate over entry edges
+				Node::AdjacencyIterator::beginAdjIter( curr_node, false );   // Iterate over exit edges
 		Node::AdjacencyIterator adj_iter_end =
-				Node::AdjacencyIterator::endAdjIter( curr_node, true );      // Iterate over entry edges
+				Node::AdjacencyIterator::endAdjIter( curr_node, false );     // Iterate over exit edges
 		while (adj_iter != adj_iter_end) {
-			Node* source_node = *adj_iter;
-			max_curr_level = std::max( source_node->getLevel() + 1, max_curr_level );
+			Node* adj_node = *adj_iter;
+			adj_node->setLevel( std::max( adj_node->getLevel(), curr_node->getLevel() + 1 ) );
+			if( --num_entries[adj_node] == 0 )
+				ready.push_back( adj_node );
 			++adj_iter;
 		}
-		curr_node->setLevel( max_curr_level );
-		max_level = std::max( max_level, max_curr_level );
 	}
+	
+	// Stable bucket pass by level
+	std::vector<size_t> level_start( max_level + 2, 0 );
+	for( size_t i = 0; i < order.size(); ++i )
+		level_start[order[i]->getLevel() + 1]++;
+	for( int l = 0; l <= max_level; ++l )
+		level_start[l + 1] += level_start[l];
+	std::vector<Node*> sorted( order.size() );
+	for( size_t i = 0; i < order.size(); ++i )
+		sorted[level_start[order[i]->getLevel()]++] = order[i];
+	
+	topo_list.insert( topo_list.end(), sorted.begin(), sorted.end() );
+}
+
+
+void Graph::resetMetricState()
+{
+	_addMutex.lock();
+	for( Graph::NodesIterator it = _graphNodes.begin(); it != _graphNodes.end(); ++it ) 
+		it->second->resetMetricState();
+	_addMutex.unlock();
+}
+
 
-	std::list<Node*>::iterator start_iter = topo_list.begin();
-	for (int i = 0; i < max_level; ++i) 
+// A zero-time node with at least one entry and one exit is bypassed by connecting each of its
+// predecessors to each of its successors, which keeps every path length. Loop nodes are kept for
+// the loop metrics, as are the nodes that folded instances are attached to, and a node is only
+// bypassed if that does not add edges. Then an edge (u,v) is removed if v is also reachable from
+// another successor of u. The search from u only visits nodes that precede v in topological order
+// and gives up after max_visits nodes, in which case the remaining edges are kept, which is
+// always safe.
+void Graph::simplify( unsigned int max_visits, unsigned int& removed_nodes, unsigned int& removed_edges,
+					  unsigned int& kept_nodes, unsigned int& bounded_nodes )
+{
+	size_t num_edges = 0;
+	for( Graph::NodesIterator it = _graphNodes.begin(); it != _graphNodes.end(); ++it ) 
+		num_edges += it->second->getExits().size();
+	removed_nodes = 0;
+	kept_nodes = 0;
+	bounded_nodes = 0;
+	
+	std::unordered_set<Node*> instance_nodes;
+	for( size_t k = 0; k < _folded.size(); ++k )
 	{
-		while( start_iter != topo_list.end() && (*start_iter)->getLevel() == i )
-			++start_iter;
-		if( start_iter == topo_list.end() )
-			break;
-		std::list<Node*>::iterator l_iter = start_iter;
-		++l_iter;
-		while( l_iter != topo_list.end() )
+		RegionTemplate::Instance& instance = _folded[k].first->_instances[_folded[k].second];
+		instance_nodes.insert( instance._entry );
+		instance_nodes.insert( instance._sink );
+		instance_nodes.insert( instance._summary );
+	}
+	
+	for( Graph::NodesIterator it = _graphNodes.begin(); it != _graphNodes.end(); ) 
+	{
+		Node* curr_node = it->second;
+		Node::NodeType type = curr_node->getType();
+		size_t num_entries = curr_node->getEntries().size();
+		size_t num_exits = curr_node->getExits().size();
+		if( curr_node->getTotalTime() != 0.0 || type == Node::WS_TASK || type == Node::CHUNK_TASK ||
+			num_entries == 0 || num_exits == 0 || instance_nodes.count( curr_node ) )
+		{
+			++it;
+			continue;
+		}
+		if( num_entries * num_exits > num_entries + num_exits )
 		{
-			Node* curr_node = *l_iter;
-			if( curr_node->getLevel() == i )
+			kept_nodes++;
+			++it;
+			continue;
+		}
+		
+		std::vector<Edge*> entries = curr_node->getEntries();
+		std::vector<Edge*> exits = curr_node->getExits();
+		for( size_t i = 0; i < entries.size(); ++i )
+			for( size_t j = 0; j < exits.size(); ++j )
+				Graph::connectNodes( entries[i]->getSource(), exits[j]->getTarget() );
+		for( size_t i = 0; i < entries.size(); ++i )
+			removeEdge( entries[i] );
+		for( size_t j = 0; j < exits.size(); ++j )
+			removeEdge( exits[j] );
+		
+		removed_nodes++;
+		delete curr_node;
+		_graphNodes.erase( it++ );
+	}
+	
+	std::list<Node*> topo_list;
+	topoSort( topo_list );
+	std::vector<Node*> order( topo_list.begin(), topo_list.end() );
+	std::unordered_map<Node*, size_t> topo_index;
+	topo_index.reserve( order.size() );
+	for( size_t i = 0; i < order.size(); ++i )
+		topo_index[order[i]] = i;
+	
+	// Node i is marked with stamp u+1 when it is reachable from u by a path of two or more edges
+	std::vector<size_t> stamp( order.size(), 0 );
+	std::vector<Node*> stack;
+	for( size_t u = 0; u < order.size(); ++u )
+	{
+		std::vector<Edge*>& exits = order[u]->getExits();
+		if( exits.size() < 2 )
+			continue;
+		
+		size_t max_index = 0;
+		for( size_t j = 0; j < exits.size(); ++j )
+			max_index = std::max( max_index, topo_index[exits[j]->getTarget()] );
+		
+		stack.clear();
+		for( size_t j = 0; j < exits.size(); ++j )
+			stack.push_back( exits[j]->getTarget() );
+		
+		unsigned int num_visits = 0;
+		while( !stack.empty() && num_visits < max_visits )
+		{
+			Node* curr_node = stack.back();
+			stack.pop_back();
+			num_visits++;
+			
+			std::vector<Edge*>& curr_exits = curr_node->getExits();
+			for( size_t j = 0; j < curr_exits.size(); ++j )
 			{
-				std::list<Node*>::iterator next_iter = l_iter;
-				++next_iter;
-				topo_list.erase( l_iter );
-				topo_list.insert( start_iter, curr_node );
-				l_iter = next_iter;
+				size_t next = topo_index[curr_exits[j]->getTarget()];
+				if( next <= max_index && stamp[next] != u + 1 )
+				{
+					stamp[next] = u + 1;
+					stack.push_back( order[next] );
+				}
 			}
-			else 
+		}
+		
+		if( !stack.empty() )
+			bounded_nodes++;
+		
+		std::vector<Edge*> redundant;
+		for( size_t j = 0; j < exits.size(); ++j )
+			if( stamp[topo_index[exits[j]->getTarget()]] == u + 1 )
+				redundant.push_back( exits[j] );
+		for( size_t j = 0; j < redundant.size(); ++j )
+			removeEdge( redundant[j] );
+	}
+	
+	for( size_t u = 0; u < order.size(); ++u )
+		num_edges -= order[u]->getExits().size();
+	removed_edges = num_edges;
+}
+
+
+void Graph::removeEdge( Edge* edge )
+{
+	std::vector<Edge*>& exit_edges = edge->getSource()->getExits();
+	exit_edges.erase( std::find( exit_edges.begin(), exit_edges.end(), edge ) );
+	std::vector<Edge*>& entry_edges = edge->getTarget()->getEntries();
+	entry_edges.erase( std::find( entry_edges.begin(), entry_edges.end(), edge ) );
+	delete edge;
+}
+
+
+static RegionTemplate::TemplateNode make_template_node( Node* node, uint64_t first_loop )
+{
+	RegionTemplate::TemplateNode tnode;
+	tnode._type = node->getType();
+	tnode._siteId = node->getSiteId();
+	tnode._threadId = node->getThreadId();
+	tnode._lower = node->getLower();
+	tnode._upper = node->getUpper();
+	tnode._loopOffset = (tnode._type == Node::CHUNK_TASK) ? (node->getLoopCounter() - first_loop) : 0;
+	tnode._chunkCount = node->getChunkCount();
+	tnode._iterCount = node->getIterCount();
+	tnode._numPapiEvents = 0;
+#ifdef HAVE_PAPI
+	tnode._numPapiEvents = node->getNumPapiEvents();
+#endif
+	tnode._fromEntry = false;
+	return tnode;
+}
+
+
+// The nodes of a region instance are reached from the exits of the entry node starting at
+// first_exit, up to the sink node
+static void collect_instance( Node* entry, size_t first_exit, Node* sink, std::vector<Node*>& members,
+							  std::unordered_map<Node*, int32_t>& index )
+{
+	entry->getExitsMutex().lock();
+	std::vector<Edge*>& entry_exits = entry->getExits();
+	for( size_t i = first_exit; i < entry_exits.size(); ++i )
+		if( index.insert( std::make_pair( entry_exits[i]->getTarget(), -1 ) ).second )
+			members.push_back( entry_exits[i]->getTarget() );
+	entry->getExitsMutex().unlock();
+	
+	for( size_t i = 0; i < members.size(); ++i )
+	{
+		std::vector<Edge*>& exits = members[i]->getExits();
+		for( size_t j = 0; j < exits.size(); ++j )
+		{
+			Node* target = exits[j]->getTarget();
+			if( target != sink && index.insert( std::make_pair( target, -1 ) ).second )
+				members.push_back( target );
+		}
+	}
+}
+
+
+template <typename T>
+static void append_raw( std::string& str, const T& value )
+{
+	str.append( (const char*)&value, sizeof( T ) );
+}
+
+
+// Signed differences are zigzag encoded in 7-bit groups, so small ones take one byte
+static void append_packed( std::string& str, int64_t value )
+{
+	uint64_t zigzag = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+	while( zigzag >= 0x80 )
+	{
+		str.push_back( (char)(zigzag | 0x80) );
+		zigzag >>= 7;
+	}
+	str.push_back( (char)zigzag );
+}
+
+static int64_t read_packed( const unsigned char*& data )
+{
+	uint64_t zigzag = 0;
+	for( unsigned int shift = 0; ; shift += 7 )
+	{
+		unsigned char byte = *data++;
+		zigzag |= (uint64_t)(byte & 0x7f) << shift;
+		if( !(byte & 0x80) )
+			break;
+	}
+	return (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+}
+
+
+typedef std::pair<std::vector<int64_t>, int64_t> OrderKey;
+
+static OrderKey make_order_key( Node* node, Node* entry, std::unordered_map<Node*, int32_t>& index, uint64_t first_loop )
+{
+	RegionTemplate::TemplateNode tnode = make_template_node( node, first_loop );
+	OrderKey key;
+	key.first.push_back( tnode._type );
+	key.first.push_back( tnode._siteId );
+	key.first.push_back( tnode._threadId );
+	key.first.push_back( tnode._lower );
+	key.first.push_back( tnode._upper );
+	key.first.push_back( tnode._loopOffset );
+	key.first.push_back( tnode._chunkCount );
+	key.first.push_back( tnode._iterCount );
+	
+	std::vector<Edge*>& entries = node->getEntries();
+	size_t num_attrs = key.first.size();
+	for( size_t i = 0; i < entries.size(); ++i )
+		key.first.push_back( (entries[i]->getSource() == entry) ? -1 : index[entries[i]->getSource()] );
+	std::sort( key.first.begin() + num_attrs, key.first.end() );
+	key.second = node->getId();
+	
+	return key;
+}
+
+
+// The nodes are numbered in a topological order in which ready nodes are taken by their attributes
+// and the numbers of their predecessors, and only then by their ids. Equal shapes of two instances
+// mean that the instances are isomorphic. The opposite may not hold for symmetric nodes, in which
+// case the instance gets its own template.
+bool Graph::foldInstance( Node* entry, size_t first_exit, Node* sink, uint64_t first_loop, uint32_t site_id,
+						  double* span )
+{
+	std::vector<Node*> members;
+	std::unordered_map<Node*, int32_t> index;
+	
+	collect_instance( entry, first_exit, sink, members, index );
+	if( members.empty() )
+		return false;
+	
+	// The instance may only be entered from the entry node
+	std::unordered_map<Node*, size_t> num_entries;
+	for( size_t i = 0; i < members.size(); ++i )
+	{
+		if( members[i]->getId() == 0 )
+			return false;
+		
+		std::vector<Edge*>& entries = members[i]->getEntries();
+		size_t& curr_entries = num_entries[members[i]];
+		for( size_t j = 0; j < entries.size(); ++j )
+		{
+			if( entries[j]->getSource() == entry )
+				continue;
+			if( index.find( entries[j]->getSource() ) == index.end() )
+				return false;
+			curr_entries++;
+		}
+	}
+	
+	std::map<OrderKey, Node*> ready;
+	for( size_t i = 0; i < members.size(); ++i )
+		if( num_entries[members[i]] == 0 )
+			ready.insert( std::make_pair( make_order_key( members[i], entry, index, first_loop ), members[i] ) );
+	
+	std::vector<Node*> order;
+	while( !ready.empty() )
+	{
+		Node* curr_node = ready.begin()->second;
+		ready.erase( ready.begin() );
+		index[curr_node] = order.size();
+		order.push_back( curr_node );
+		
+		std::vector<Edge*>& exits = curr_node->getExits();
+		for( size_t j = 0; j < exits.size(); ++j )
+		{
+			Node* target = exits[j]->getTarget();
+			if( target != sink && --num_entries[target] == 0 )
+				ready.insert( std::make_pair( make_order_key( target, entry, index, first_loop ), target ) );
+		}
+	}
+	if( order.size() != members.size() )
+		return false;
+	
+	// The shape is the serialized template
+	std::vector<RegionTemplate::TemplateNode> tnodes( order.size() );
+	std::string shape;
+	for( size_t i = 0; i < order.size(); ++i )
+	{
+		RegionTemplate::TemplateNode& tnode = tnodes[i];
+		tnode = make_template_node( order[i], first_loop );
+		
+		std::vector<Edge*>& entries = order[i]->getEntries();
+		for( size_t j = 0; j < entries.size(); ++j )
+			tnode._fromEntry |= (entries[j]->getSource() == entry);
+		std::vector<Edge*>& exits = order[i]->getExits();
+		for( size_t j = 0; j < exits.size(); ++j )
+			tnode._exits.push_back( (exits[j]->getTarget() == sink) ? -1 : index[exits[j]->getTarget()] );
+		std::sort( tnode._exits.begin(), tnode._exits.end() );
+		
+		append_raw( shape, tnode._type );
+		append_raw( shape, tnode._siteId );
+		append_raw( shape, tnode._loopOffset );
+		append_raw( shape, tnode._numPapiEvents );
+		append_raw( shape, tnode._fromEntry );
+		append_raw( shape, tnode._exits.size() );
+		for( size_t j = 0; j < tnode._exits.size(); ++j )
+			append_raw( shape, tnode._exits[j] );
+	}
+	
+	// Longest paths in time and in edges, in template order
+	std::vector<double> finish( order.size(), 0.0 );
+	std::vector<int> length( order.size(), 0 );
+	double instance_span = 0.0;
+	int path_length = 0;
+	bool to_sink = false;
+	for( size_t i = 0; i < order.size(); ++i )
+	{
+		finish[i] += order[i]->getSpanTime();
+		instance_span = std::max( instance_span, finish[i] );
+		path_length = std::max( path_length, length[i] );
+		for( size_t j = 0; j < tnodes[i]._exits.size(); ++j )
+		{
+			int32_t target = tnodes[i]._exits[j];
+			to_sink |= (target < 0);
+			if( target < 0 )
+				continue;
+			finish[target] = std::max( finish[target], finish[i] );
+			length[target] = std::max( length[target], length[i] + 1 );
+		}
+	}
+	
+	Node* summary = new Node( Node::nextId(), Node::IMP_TASK, instance_span );
+	summary->setSiteId( site_id );
+	if( span )
+		*span = instance_span;
+	
+	_templatesMutex.lock();
+	RegionTemplate*& tmpl = _templates[shape];
+	if( !tmpl )
+	{
+		tmpl = new RegionTemplate;
+		tmpl->_nodes.swap( tnodes );
+		tmpl->_pathLength = path_length;
+	}
+	RegionTemplate::Instance instance = { entry, sink, summary, first_loop, tmpl->_packed.size(), tmpl->_values.size() };
+	_instanceNodes[summary] = _folded.size();
+	_folded.push_back( std::make_pair( tmpl, tmpl->_instances.size() ) );
+	tmpl->_instances.push_back( instance );
+	int64_t prev_id = 0;
+	for( size_t i = 0; i < order.size(); ++i )
+	{
+		RegionTemplate::TemplateNode& base = tmpl->_nodes[i];
+		append_packed( tmpl->_packed, order[i]->getId() - prev_id );
+		append_packed( tmpl->_packed, order[i]->getThreadId() - base._threadId );
+		append_packed( tmpl->_packed, order[i]->getLower() - base._lower );
+		append_packed( tmpl->_packed, order[i]->getUpper() - base._upper );
+		append_packed( tmpl->_packed, (int64_t)order[i]->getChunkCount() - base._chunkCount );
+		append_packed( tmpl->_packed, order[i]->getIterCount() - base._iterCount );
+		prev_id = order[i]->getId();
+		
+		tmpl->_values.push_back( order[i]->getTotalTime() );
+		if( order[i]->getType() == Node::CHUNK_TASK )
+		{
+			tmpl->_values.push_back( order[i]->getToolTime() );
+			if( order[i]->getChunkCount() > 1 )
+				tmpl->_values.push_back( order[i]->getMaxChunkTime() );
+		}
+#ifdef HAVE_PAPI
+		tmpl->_papiVals.insert( tmpl->_papiVals.end(), order[i]->getPapiVals(), 
+								order[i]->getPapiVals() + order[i]->getNumPapiEvents() );
+#endif
+	}
+	_templatesMutex.unlock();
+	
+	// The edges from the entry node are the last ones it has
+	entry->getExitsMutex().lock();
+	std::vector<Edge*>& entry_exits = entry->getExits();
+	for( size_t i = first_exit; i < entry_exits.size(); ++i )
+		delete entry_exits[i];
+	entry_exits.resize( first_exit );
+	entry->getExitsMutex().unlock();
+	
+	sink->getEntriesMutex().lock();
+	std::vector<Edge*>& sink_entries = sink->getEntries();
+	std::vector<Edge*> kept_entries;
+	for( size_t i = 0; i < sink_entries.size(); ++i )
+		if( index.find( sink_entries[i]->getSource() ) == index.end() )
+			kept_entries.push_back( sink_entries[i] );
+	sink_entries.swap( kept_entries );
+	sink->getEntriesMutex().unlock();
+	
+	for( size_t i = 0; i < order.size(); ++i )
+	{
+		std::vector<Edge*>& exits = order[i]->getExits();
+		for( size_t j = 0; j < exits.size(); ++j )
+			delete exits[j];
+		removeNode( order[i]->getId() );
+		delete order[i];
+	}
+	
+	addNode( summary->getId(), summary );
+	connectNodes( entry, summary );
+	if( to_sink )
+		connectNodes( summary, sink );
+	
+	return true;
+}
+
+
+void Graph::createInstanceNodes( RegionTemplate* tmpl, size_t idx, std::vector<Node*>& nodes )
+{
+	std::vector<RegionTemplate::TemplateNode>& tnodes = tmpl->_nodes;
+	
+	// The PAPI values of an instance take the same space in every instance of the template
+	size_t num_papi_vals = 0;
+	for( size_t i = 0; i < tnodes.size(); ++i )
+		num_papi_vals += tnodes[i]._numPapiEvents;
+	
+	RegionTemplate::Instance& instance = tmpl->_instances[idx];
+	const unsigned char* packed = (const unsigned char*)tmpl->_packed.data() + instance._packedOffset;
+	const double* values = tmpl->_values.data() + instance._valuesOffset;
+#ifdef HAVE_PAPI
+	const long long* papi_vals = tmpl->_papiVals.data() + idx * num_papi_vals;
+#endif
+	
+	nodes.resize( tnodes.size() );
+	int64_t id = 0;
+	for( size_t i = 0; i < tnodes.size(); ++i )
+	{
+		RegionTemplate::TemplateNode& tnode = tnodes[i];
+		id += read_packed( packed );
+		int thread_id = tnode._threadId + (int)read_packed( packed );
+		int64_t lower = tnode._lower + read_packed( packed );
+		int64_t upper = tnode._upper + read_packed( packed );
+		unsigned int chunk_count = tnode._chunkCount + (unsigned int)read_packed( packed );
+		int64_t iter_count = tnode._iterCount + read_packed( packed );
+		
+		Node* node = new Node( id, tnode._type, *values++ );
+		node->setSiteId( tnode._siteId );
+		node->setThreadId( thread_id );
+		node->setLowerUpper( lower, upper );
+		node->setIterCount( iter_count );
+		if( tnode._type == Node::CHUNK_TASK )
+		{
+			node->setLoopCounter( instance._firstLoop + tnode._loopOffset );
+			node->setToolTime( *values++ );
+			node->setChunkStats( chunk_count, (chunk_count > 1) ? *values++ : node->getTotalTime() );
+		}
+#ifdef HAVE_PAPI
+		node->initPapiVals( tnode._numPapiEvents );
+		std::copy( papi_vals, papi_vals + tnode._numPapiEvents, node->getPapiVals() );
+		papi_vals += tnode._numPapiEvents;
+#endif
+		nodes[i] = node;
+	}
+	
+	for( size_t i = 0; i < tnodes.size(); ++i )
+		for( size_t j = 0; j < tnodes[i]._exits.size(); ++j )
+			if( tnodes[i]._exits[j] >= 0 )
+				connectNodes( nodes[i], nodes[tnodes[i]._exits[j]] );
+}
+
+
+Node* Graph::expandInstance( size_t instance_id, Graph& instance )
+{
+	// A concurrent fold may add an instance to the same template and move its vectors
+	std::vector<Node*> nodes;
+	_templatesMutex.lock();
+	RegionTemplate* tmpl = _folded[instance_id].first;
+	size_t idx = _folded[instance_id].second;
+	createInstanceNodes( tmpl, idx, nodes );
+	Node* summary = tmpl->_instances[idx]._summary;
+	_templatesMutex.unlock();
+	
+	for( size_t i = 0; i < nodes.size(); ++i )
+		instance._graphNodes[nodes[i]->getId()] = nodes[i];
+	
+	return summary;
+}
+
+
+bool Graph::isInstanceNode( Node* node, size_t* instance_id )
+{
+	_templatesMutex.lock();
+	std::unordered_map<Node*, size_t>::iterator it = _instanceNodes.find( node );
+	bool found = (it != _instanceNodes.end());
+	if( found && instance_id )
+		*instance_id = it->second;
+	_templatesMutex.unlock();
+	
+	return found;
+}
+
+
+int Graph::getInstancePathLength( Node* node )
+{
+	size_t instance_id;
+	if( !isInstanceNode( node, &instance_id ) )
+		return 0;
+	
+	_templatesMutex.lock();
+	int path_length = _folded[instance_id].first->_pathLength;
+	_templatesMutex.unlock();
+	
+	return path_length;
+}
+
+
+bool Graph::extractInstance( Node* entry, size_t first_exit, Node* sink, Graph& region )
+{
+	std::vector<Node*> members;
+	std::unordered_map<Node*, int32_t> index;
+	
+	collect_instance( entry, first_exit, sink, members, index );
+	if( members.empty() )
+		return false;
+	
+	// The instance may only be entered from the entry node
+	for( size_t i = 0; i < members.size(); ++i )
+	{
+		if( members[i]->getId() == 0 )
+			return false;
+		
+		std::vector<Edge*>& entries = members[i]->getEntries();
+		for( size_t j = 0; j < entries.size(); ++j )
+			if( entries[j]->getSource() != entry && index.find( entries[j]->getSource() ) == index.end() )
+				return false;
+	}
+	
+	// The edges are cut while they are still alive: first the entries of the sink node, then the
+	// members, and the edges from the entry node are deleted last
+	sink->getEntriesMutex().lock();
+	std::vector<Edge*>& sink_entries = sink->getEntries();
+	std::vector<Edge*> kept_entries;
+	for( size_t i = 0; i < sink_entries.size(); ++i )
+		if( index.find( sink_entries[i]->getSource() ) == index.end() )
+			kept_entries.push_back( sink_entries[i] );
+	sink_entries.swap( kept_entries );
+	sink->getEntriesMutex().unlock();
+	
+	for( size_t i = 0; i < members.size(); ++i )
+	{
+		std::vector<Edge*>& entries = members[i]->getEntries();
+		std::vector<Edge*> kept_edges;
+		for( size_t j = 0; j < entries.size(); ++j )
+			if( entries[j]->getSource() != entry )
+				kept_edges.push_back( entries[j] );
+		entries.swap( kept_edges );
+		
+		std::vector<Edge*>& exits = members[i]->getExits();
+		kept_edges.clear();
+		for( size_t j = 0; j < exits.size(); ++j )
+		{
+			if( exits[j]->getTarget() == sink )
+				delete exits[j];
+			else
+				kept_edges.push_back( exits[j] );
+		}
+		exits.swap( kept_edges );
+	}
+	
+	entry->getExitsMutex().lock();
+	std::vector<Edge*>& entry_exits = entry->getExits();
+	for( size_t i = first_exit; i < entry_exits.size(); ++i )
+		delete entry_exits[i];
+	entry_exits.resize( first_exit );
+	entry->getExitsMutex().unlock();
+	
+	for( size_t i = 0; i < members.size(); ++i )
+	{
+		removeNode( members[i]->getId() );
+		region._graphNodes[members[i]->getId()] = members[i];
+	}
+	
+	return true;
+}
+
+
+void Graph::measureInstance( Node* entry, size_t first_exit, Node* sink, double& work, double& span )
+{
+	std::vector<Node*> members;
+	std::unordered_map<Node*, int32_t> index;
+	
+	collect_instance( entry, first_exit, sink, members, index );
+	
+	std::unordered_map<Node*, size_t> num_entries;
+	for( size_t i = 0; i < members.size(); ++i )
+	{
+		std::vector<Edge*>& entries = members[i]->getEntries();
+		size_t& curr_entries = num_entries[members[i]];
+		for( size_t j = 0; j < entries.size(); ++j )
+			if( index.find( entries[j]->getSource() ) != index.end() )
+				curr_entries++;
+	}
+	
+	std::vector<Node*> ready;
+	for( size_t i = 0; i < members.size(); ++i )
+		if( num_entries[members[i]] == 0 )
+			ready.push_back( members[i] );
+	
+	// Longest path from the entry to the sink, in topological order
+	std::unordered_map<Node*, double> finish;
+	work = 0.0;
+	span = 0.0;
+	while( !ready.empty() )
+	{
+		Node* curr_node = ready.back();
+		ready.pop_back();
+		work += curr_node->getTotalTime();
+		double& curr_finish = finish[curr_node];
+		curr_finish += curr_node->getSpanTime();
+		span = std::max( span, curr_finish );
+		
+		std::vector<Edge*>& exits = curr_node->getExits();
+		for( size_t j = 0; j < exits.size(); ++j )
+		{
+			Node* target = exits[j]->getTarget();
+			if( target == sink )
+				continue;
+			double& target_finish = finish[target];
+			target_finish = std::max( target_finish, curr_finish );
+			if( --num_entries[target] == 0 )
+				ready.push_back( target );
+		}
+	}
+}
+
+
+void Graph::recordSample( uint32_t site_id, bool sampled, double counted_work, double work, double span )
+{
+	_samplesMutex.lock();
+	SampleSite& sample = _samples[site_id];
+	sample._numInstances++;
+	sample._countedWork += counted_work;
+	if( sampled )
+	{
+		sample._numSampled++;
+		sample._workSum += work;
+		sample._workSqSum += work * work;
+		sample._spanSum += span;
+		sample._spanSqSum += span * span;
+	}
+	_samplesMutex.unlock();
+}
+
+
+void Graph::copyNodesBelow( int64_t watermark, Graph& snapshot )
+{
+	std::vector<Node*> originals;
+	std::vector<Node*> nodes;
+	std::unordered_map<Node*, Node*> copies;
+	
+	_addMutex.lock();
+	NodesIterator end_it = _graphNodes.lower_bound( watermark );
+	for( NodesIterator it = _graphNodes.begin(); it != end_it; ++it )
+		originals.push_back( it->second );
+	_addMutex.unlock();
+	
+	for( size_t i = 0; i < originals.size(); ++i )
+	{
+		Node* orig = originals[i];
+		Node* node = new Node( orig->getId(), orig->getType(), orig->getTotalTime() );
+		node->setSiteId( orig->getSiteId() );
+		node->setThreadId( orig->getThreadId() );
+		node->setLowerUpper( orig->getLower(), orig->getUpper() );
+		node->setLoopCounter( orig->getLoopCounter() );
+		node->setToolTime( orig->getToolTime() );
+		node->setIterCount( orig->getIterCount() );
+		node->setChunkStats( orig->getChunkCount(), orig->getMaxChunkTime() );
+#ifdef HAVE_PAPI
+		node->initPapiVals( orig->getNumPapiEvents() );
+		if( orig->getPapiVals() )
+			std::copy( orig->getPapiVals(), orig->getPapiVals() + orig->getNumPapiEvents(), node->getPapiVals() );
+#endif
+		snapshot._graphNodes[node->getId()] = node;
+		nodes.push_back( node );
+		copies[orig] = node;
+	}
+	
+	// Edges to the nodes above the watermark (e.g., from the node of the sequential code to a
+	// running region) are left out
+	std::vector<Node*> targets;
+	for( size_t i = 0; i < originals.size(); ++i )
+	{
+		targets.clear();
+		originals[i]->getExitsMutex().lock();
+		std::vector<Edge*>& exits = originals[i]->getExits();
+		for( size_t j = 0; j < exits.size(); ++j )
+			if( exits[j]->getTarget()->getId() < watermark )
+				targets.push_back( exits[j]->getTarget() );
+		originals[i]->getExitsMutex().unlock();
+		
+		for( size_t j = 0; j < targets.size(); ++j )
+		{
+			std::unordered_map<Node*, Node*>::iterator it = copies.find( targets[j] );
+			if( it != copies.end() )
+				connectNodes( nodes[i], it->second );
+		}
+	}
+	
+	copySites( snapshot );
+}
+
+
+// The names are resolved here, so the target does not decode the line tables again
+void Graph::copySites( Graph& target )
+{
+	getSiteName( 0 );
+	_sitesMutex.lock();
+	target._sites = _sites;
+	target._siteNames = _siteNames;
+	_sitesMutex.unlock();
+}
+
+
+void Graph::copyLoops( Graph& target )
+{
+	std::map<uint64_t, uint64_t> new_idx;
+	for( NodesIterator it = target._graphNodes.begin(); it != target._graphNodes.end(); ++it )
+		if( it->second->getType() == Node::CHUNK_TASK )
+			new_idx[it->second->getLoopCounter()] = UINT64_MAX;
+	
+	_loopsMutex.lock();
+	for( std::map<uint64_t, uint64_t>::iterator it = new_idx.begin(); it != new_idx.end(); ++it )
+	{
+		if( it->first >= _loops.size() )
+			continue;
+		it->second = target._loops.size();
+		target._loops.push_back( new LoopInfo( *_loops[it->first] ) );
+	}
+	_loopsMutex.unlock();
+	
+	for( NodesIterator it = target._graphNodes.begin(); it != target._graphNodes.end(); ++it )
+		if( it->second->getType() == Node::CHUNK_TASK )
+			it->second->setLoopCounter( new_idx[it->second->getLoopCounter()] );
+}
+
+
+void Graph::expandTemplates( unsigned int& num_templates, unsigned int& num_instances )
+{
+	num_templates = _templates.size();
+	num_instances = _folded.size();
+	
+	std::vector<Node*> nodes;
+	for( size_t k = 0; k < _folded.size(); ++k )
+	{
+		RegionTemplate* tmpl = _folded[k].first;
+		RegionTemplate::Instance& instance = tmpl->_instances[_folded[k].second];
+		
+		Node* summary = instance._summary;
+		std::vector<Edge*> summary_edges = summary->getEntries();
+		summary_edges.insert( summary_edges.end(), summary->getExits().begin(), summary->getExits().end() );
+		for( size_t i = 0; i < summary_edges.size(); ++i )
+			removeEdge( summary_edges[i] );
+		removeNode( summary->getId() );
+		delete summary;
+		
+		createInstanceNodes( tmpl, _folded[k].second, nodes );
+		for( size_t i = 0; i < nodes.size(); ++i )
+		{
+			addNode( nodes[i]->getId(), nodes[i] );
+			if( tmpl->_nodes[i]._fromEntry )
+				connectNodes( instance._entry, nodes[i] );
+			for( size_t j = 0; j < tmpl->_nodes[i]._exits.size(); ++j )
+				if( tmpl->_nodes[i]._exits[j] < 0 )
+					connectNodes( nodes[i], instance._sink );
+		}
+	}
+	
+	for( std::unordered_map<std::string, RegionTemplate*>::iterator it = _templates.begin(); it != _templates.end(); ++it )
+		delete it->second;
+	_templates.clear();
+	_folded.clear();
+	_instanceNodes.clear();
+}
+
+
+LoopInfo* Graph::createLoop( const void* codeptr, uint32_t site_id, int sched, int64_t lower, int64_t upper,
+							  int64_t step, uint64_t chunk_size, unsigned int team_size )
+{
+	_loopsMutex.lock();
+	LoopInfo* loop = new LoopInfo( _loops.size(), codeptr, site_id, sched, lower, upper, step, chunk_size, team_size );
+	_loops.push_back( loop );
+	_loopsMutex.unlock();
+	
+	return loop;
+}
+
+
+uint32_t Graph::internSite( const void* codeptr, bool* selected )
+{
+	if( !codeptr )
+	{
+		if( selected )
+			*selected = _siteSelected[0];
+		return 0;
+	}
+	
+	_sitesMutex.lock();
+	std::unordered_map<const void*, uint32_t>::iterator it = _siteIds.find( codeptr );
+	if( it == _siteIds.end() )
+	{
+		it = _siteIds.insert( std::make_pair( codeptr, (uint32_t)_sites.size() ) ).first;
+		_sites.push_back( codeptr );
+		_siteSelected.push_back( _siteFilters.empty() || matchSiteFilters( codeptr ) );
+	}
+	uint32_t site_id = it->second;
+	if( selected )
+		*selected = _siteSelected[site_id];
+	_sitesMutex.unlock();
+	
+	return site_id;
+}
+
+
+// Source ranges need the "file:line" of the address, which is resolved when the site is first seen
+bool Graph::matchSiteFilters( const void* codeptr )
+{
+	std::string name;
+	uint64_t line = 0;
+	
+	for( std::vector<SiteFilter>::const_iterator it = _siteFilters.begin(); it != _siteFilters.end(); ++it )
+	{
+		if( it->_file.empty() )
+		{
+			if( (uint64_t)codeptr >= it->_first && (uint64_t)codeptr <= it->_last )
+				return true;
+			continue;
+		}
+		
+		if( name.empty() )
+		{
+			if( !_resolver )
+				_resolver = new SymbolResolver;
+			name = _resolver->resolve( codeptr );
+			size_t colon_pos = name.rfind( ':' );
+			if( colon_pos != std::string::npos )
 			{
-				++l_iter;
+				line = std::strtoull( name.c_str() + colon_pos + 1, NULL, 10 );
+				name.erase( colon_pos );
 			}
 		}
+		
+		size_t file_len = it->_file.size();
+		bool file_match = (name.size() >= file_len) && (name.compare( name.size() - file_len, file_len, it->_file ) == 0) &&
+						  (name.size() == file_len || name[name.size() - file_len - 1] == '/');
+		if( file_match && line >= it->_first && line <= it->_last )
+			return true;
+	}
+	return false;
+}
+
+
+void Graph::deleteResolver()
+{
+	delete _resolver;
+	_resolver = NULL;
+}
+
+
+const std::string& Graph::getSiteName( uint32_t site_id )
+{
+	_sitesMutex.lock();
+	if( _siteNames.size() < _sites.size() )
+	{
+		if( !_resolver )
+			_resolver = new SymbolResolver;
+		_siteNames.reserve( _sites.size() );
+		if( _siteNames.empty() )
+			_siteNames.push_back( "unknown" );
+		for( uint32_t i = _siteNames.size(); i < _sites.size(); ++i )
+			_siteNames.push_back( _resolver->resolve( _sites[i] ) );
 	}
+	_sitesMutex.unlock();
+	
+	return _siteNames[(site_id < _siteNames.size()) ? site_id : 0];
 }
 
 
@@ -293,12 +1286,20 @@ void Graph::printDotFile( const std::string& file_name )
 		exit( -2 );
 	}
 	
-	dot_file << "digraph {" << std::endl;
+	printDot( dot_file );
+
+	dot_file.close();
+}
+
+
+void Graph::printDot( std::ostream& dot_file, const std::string& graph_name )
+{
+	dot_file << "digraph " << (graph_name.empty() ? "" : graph_name + " ") << "{" << std::endl;
 	for (Graph::NodesIterator it = _graphNodes.begin(); it != _graphNodes.end(); ++it) 
 	{
 		Node* curr_node = it->second;
 				
-		curr_node->printToStream( dot_file );
+		curr_node->printToStream( dot_file, curr_node->getSiteId() ? getSiteName( curr_node->getSiteId() ).c_str() : NULL );
 
 		Node::AdjacencyIterator adj_iter =
 				Node::AdjacencyIterator::beginAdjIter (curr_node, false);   // Iterate over exit edges
@@ -312,8 +1313,6 @@ void Graph::printDotFile( const std::string& file_name )
 		}
 	}
 	dot_file << "}" << std::endl;
-
-	dot_file.close();
 }
 
 //int64_t Graph::getMaxInternalId( ) 
@@ -24,16 +24,27 @@
 
 #include <stdint.h>
 #include <cstdlib>
+#include <algorithm>
 #include <vector>
 #include <map>
 #include <list>
 #include <mutex>
 #include <atomic>
 #include <string>
+#include <unordered_map>
 
 
 #define EPSILON     0.00001
 
+#define SITE_HIST_MIN_TIME			1e-6	// ms
+#define SITE_HIST_BINS_PER_DECADE	16
+#define SITE_HIST_BINS				192
+
+#define SIMPLIFY_MAX_VISITS			4096	// Per node, bounds the transitive reduction search (default)
+
+#define CALLBACK_HIST_SUB_BINS		8		// Bins per power of two of the callback cycles
+#define CALLBACK_HIST_BINS			(62 * CALLBACK_HIST_SUB_BINS)
+
 
 namespace libtdg
 {
@@ -67,7 +78,8 @@ namespace libtdg
 			CHUNK_TASK,
 			EXP_TASK,
 			BARRIER,
-			TASKWAIT
+			TASKWAIT,
+			NUM_NODE_TYPES
 		};
 	
 		class AdjacencyIterator {
@@ -111,7 +123,9 @@ namespace libtdg
 		Node( int64_t id, NodeType type, double total_time )
 			: _id( id ), _type( type ), _totalTime( total_time ), _visited( false ), 
 			  _level( -1 ), _finishTime( 0.0 ), _lastTime( 0.0 ), _lower( 0 ), _upper( 0 ),
-			  _isCritical( false ),_pathLength( 0 ), _pathTime( 0.0 ), _prevCritical( NULL ) 
+			  _loopCounter( 0 ), _threadId( 0 ), _toolTime( 0.0 ), _siteId( 0 ),
+			  _chunkCount( 1 ), _iterCount( 0 ), _maxChunkTime( 0.0 ),
+			  _isCritical( false ),_pathLength( 0 ), _pathTime( 0.0 ), _prevCritical( NULL ), _slack( -1.0 ) 
 #ifdef HAVE_PAPI
 			  , _numPapiEvents(0), _papiValsArr( NULL )
 #endif
@@ -133,6 +147,7 @@ namespace libtdg
 		double  	getPathTime() const 	{ return _pathTime; 	}
 		Node*		getPrevCritical() const { return _prevCritical;	}
 		bool		getIsCritical() const 	{ return _isCritical;	}
+		double		getSlack() const		{ return _slack;		}
 		NodeType	getType() const			{ return _type;			}
 		int64_t		getLower() const		{ return _lower;		}
 		int64_t		getUpper() const		{ return _upper;		}
@@ -144,23 +159,43 @@ namespace libtdg
 		const char*			getFillColor() 		{ return _fillColors[_type]; 	}
 		uint64_t			getLoopCounter()	{ return _loopCounter;			}
 		int					getThreadId()		{ return _threadId;				}
+		double				getToolTime()		{ return _toolTime;				}
+		uint32_t			getSiteId()			{ return _siteId;				}
+		unsigned int		getChunkCount()		{ return _chunkCount;			}
+		int64_t				getIterCount()		{ return _iterCount;			}
+		double				getMaxChunkTime()	{ return _maxChunkTime;			}
+		
+		// Coalesced chunks ran one after the other but stand for independent chunks of the loop,
+		// so only the longest of them is on a path of the graph
+		double getSpanTime() const { return (_chunkCount > 1) ? _maxChunkTime : _totalTime; }
     
 		void setLevel( int level ) 				{ _level = level; 				}
+		void setTotalTime( double total_time )	{ _totalTime = total_time; 		}
 		void setVisited( bool visited ) 		{ _visited = visited; 			}
 		void setLastTime( double last_time ) 	{ _lastTime = last_time; 		}
 		void setIsCritical( bool is_critical )	{ _isCritical = is_critical; 	}
 		void setPrevCritical( Node* prev )		{ _prevCritical = prev; 		}
 		void setPathLength( int path_length )	{ _pathLength = path_length;	}
 		void setPathTime( double path_time )	{ _pathTime = path_time;		}
+		void setSlack( double slack )			{ _slack = slack;				}
 		void setLowerUpper( int64_t lower, int64_t upper )	{ _lower = lower; _upper = upper; 	}
 		void setLoopCounter( uint64_t loop_cnt )			{ _loopCounter = loop_cnt; 			}
 		void setThreadId( int thread_id )		{ _threadId = thread_id; 		}
+		void setToolTime( double tool_time )	{ _toolTime = tool_time;		}
+		void setSiteId( uint32_t site_id )		{ _siteId = site_id;			}
+		void setIterCount( int64_t iter_count )	{ _iterCount = iter_count;		}
+		void addToolTime( double tool_time )	{ _toolTime += tool_time;		}
+		void setChunkStats( unsigned int chunk_count, double max_chunk_time )	{ _chunkCount = chunk_count; _maxChunkTime = max_chunk_time; }
     
 		double maxPredFinishTime ();
 		bool isConnectedWith (Node* target);
 		Edge* getConnection (Node* target) const;
 		void addTime( double curr_time ) { _totalTime += (curr_time - _lastTime); _lastTime = curr_time; }
-		void printToStream( std::ostream& str_stream );
+		void addChunkTime( double chunk_time ) { _totalTime += chunk_time; _maxChunkTime = std::max( _maxChunkTime, chunk_time ); }
+		void endChunk( double curr_time ) { addChunkTime( curr_time - _lastTime ); _lastTime = curr_time; }
+		void coalesceChunk( int64_t lower, int64_t upper, int64_t iter_count );
+		void resetMetricState() { _isCritical = false; _pathLength = 0; _pathTime = 0.0; _prevCritical = NULL; _slack = -1.0; }
+		void printToStream( std::ostream& str_stream, const char* site_name = NULL );
 		std::string papiValsToStr( const char* sep_str );
 		std::string idToStr();
 		
@@ -168,9 +203,15 @@ namespace libtdg
 		void initPapiVals( unsigned int num_papi_events );
 		void startPapiCounters( int papi_eventset );
 		void endPapiCounters( int papi_eventset );
+		unsigned int getNumPapiEvents()			{ return _numPapiEvents;		}
+		long long* getPapiVals()				{ return _papiValsArr;			}
 #endif
     
 		static int64_t nextId() { int64_t nid = _nextId.fetch_add( 1 ); return nid; }
+		
+		static int64_t peekNextId() { return _nextId.load(); }
+		
+		static const char* typeToStr( NodeType type ) { return _typeStrings[type]; }
 
 	private:
 		int64_t 	_id;
@@ -186,12 +227,18 @@ namespace libtdg
 		int64_t		_upper;
 		uint64_t	_loopCounter;
 		int			_threadId;
+		double		_toolTime;		// Time of the tool in the chunk callbacks that started this chunk
+		uint32_t	_siteId;		// Interned codeptr_ra of the region, loop or task, 0 if unknown
+		unsigned int	_chunkCount;	// Number of chunks coalesced into this node
+		int64_t			_iterCount;		// Number of iterations of the chunks
+		double			_maxChunkTime;	// Time of the longest coalesced chunk
 				
 		// Members for critical path computation
 		bool			_isCritical;
 		int 			_pathLength;
 		double 			_pathTime;
         Node*           _prevCritical;
+		double			_slack;			// Latest minus earliest finish time, -1 if not computed
         
 #ifdef HAVE_PAPI
 		unsigned int	_numPapiEvents;
@@ -211,16 +258,242 @@ namespace libtdg
 
 	//=================================
 
+	class LoopInfo {
+	public:
+		// Ctor
+		LoopInfo( uint64_t id, const void* codeptr, uint32_t site_id, int sched, int64_t lower, int64_t upper,
+				  int64_t step, uint64_t chunk_size, unsigned int team_size )
+			: _id( id ), _codeptr( codeptr ), _siteId( site_id ), _sched( sched ), _lower( lower ), _upper( upper ),
+			  _step( step ), _chunkSize( chunk_size ), _teamSize( team_size ) {}
+
+		uint64_t		getId() const			{ return _id;			}
+		const void*		getCodeptr() const		{ return _codeptr;		}
+		uint32_t		getSiteId() const		{ return _siteId;		}
+		int				getSched() const		{ return _sched;		}
+		int64_t			getLower() const		{ return _lower;		}
+		int64_t			getUpper() const		{ return _upper;		}
+		int64_t			getStep() const			{ return _step;			}
+		uint64_t		getChunkSize() const	{ return _chunkSize;	}
+		unsigned int	getTeamSize() const		{ return _teamSize;		}
+
+	private:
+		uint64_t		_id;
+		const void*		_codeptr;	// Call site of the loop construct
+		uint32_t		_siteId;
+		int				_sched;		// ext_loop_sched_t
+		int64_t			_lower;
+		int64_t			_upper;
+		int64_t			_step;
+		uint64_t		_chunkSize;
+		unsigned int	_teamSize;
+	};
+
+	//=================================
+
+	// Online statistics of the instances of one call site. The instance times are kept in a 
+	// log-scale histogram, so the percentiles are approximate.
+	class SiteStats {
+	public:
+		enum SiteKind {
+			REGION_SITE = 0,
+			LOOP_SITE,
+			TASK_SITE
+		};
+		
+		// Ctor
+		SiteStats() 
+			: _kind( TASK_SITE ), _numInstances( 0 ), _totalTime( 0.0 ), _maxTime( 0.0 ), 
+			  _work( 0.0 ), _capacity( 0.0 ), _hist( SITE_HIST_BINS, 0 ) {}
+		
+		SiteKind	getKind() const			{ return _kind;			}
+		uint64_t	getNumInstances() const	{ return _numInstances;	}
+		double		getTotalTime() const	{ return _totalTime;	}
+		double		getMaxTime() const		{ return _maxTime;		}
+		double		getWork() const			{ return _work;			}
+		double		getCapacity() const		{ return _capacity;		}
+		const char*	getKindStr() const		{ return _kindStrings[_kind];	}
+		
+		// Time is the duration of the instance, work is the time the threads were busy in it and 
+		// capacity is the duration times the number of threads (0 for tasks)
+		void addInstance( SiteKind kind, double time, double work, double capacity );
+		void merge( const SiteStats& other );
+		double getPercentile( double fraction ) const;
+		
+	private:
+		SiteKind				_kind;
+		uint64_t				_numInstances;
+		double					_totalTime;
+		double					_maxTime;
+		double					_work;
+		double					_capacity;
+		std::vector<uint64_t>	_hist;
+		
+		static const char*		_kindStrings[3];
+	};
+	
+	typedef std::unordered_map<uint32_t, SiteStats> SiteStatsTable;
+	
+	// Callbacks of the tool measured by the self metric
+	enum ToolCallback {
+		TOOL_CB_THREAD_BEGIN = 0,
+		TOOL_CB_THREAD_END,
+		TOOL_CB_PARALLEL_BEGIN,
+		TOOL_CB_PARALLEL_END,
+		TOOL_CB_IMPLICIT_TASK,
+		TOOL_CB_TASK_CREATE,
+		TOOL_CB_TASK_SCHEDULE,
+		TOOL_CB_TASK_DEPENDENCES,
+		TOOL_CB_TASK_DEPENDENCE,
+		TOOL_CB_WORK,
+		TOOL_CB_SYNC_REGION,
+		TOOL_CB_SYNC_REGION_WAIT,
+		TOOL_CB_EXT_LOOP,
+		TOOL_CB_EXT_CHUNK,
+		NUM_TOOL_CALLBACKS
+	};
+	
+	// TSC cycles of the calls of one callback. The histogram has CALLBACK_HIST_SUB_BINS bins per 
+	// power of two, so the percentiles are within 1/8 of the value.
+	class CallbackStats {
+	public:
+		CallbackStats() : _count( 0 ), _total( 0 ), _min( UINT64_MAX ), _max( 0 ), _hist( CALLBACK_HIST_BINS, 0 ) {}
+		
+		uint64_t	getCount() const		{ return _count;	}
+		uint64_t	getTotal() const		{ return _total;	}
+		uint64_t	getMin() const			{ return _count ? _min : 0;	}
+		uint64_t	getMax() const			{ return _max;		}
+		
+		void add( uint64_t cycles )
+		{
+			_count++;
+			_total += cycles;
+			_min = std::min( _min, cycles );
+			_max = std::max( _max, cycles );
+			_hist[getBin( cycles )]++;
+		}
+		void merge( const CallbackStats& other );
+		uint64_t getPercentile( double fraction ) const;
+		
+		static const char* getName( ToolCallback callback ) { return _names[callback]; }
+		
+	private:
+		static unsigned int getBin( uint64_t cycles )
+		{
+			if( cycles < CALLBACK_HIST_SUB_BINS )
+				return cycles;
+			unsigned int exp = 63 - __builtin_clzll( cycles );
+			return (exp - 2) * CALLBACK_HIST_SUB_BINS + ((cycles >> (exp - 3)) & (CALLBACK_HIST_SUB_BINS - 1));
+		}
+		
+		uint64_t				_count;
+		uint64_t				_total;
+		uint64_t				_min;
+		uint64_t				_max;
+		std::vector<uint64_t>	_hist;
+		
+		static const char*		_names[NUM_TOOL_CALLBACKS];
+	};
+	
+	typedef std::vector<CallbackStats> CallbackProfile;		// Of one thread, by ToolCallback
+	
+	// A source range ("file:first-last") or an address range of the sites that produce nodes
+	struct SiteFilter
+	{
+		SiteFilter() : _first( 0 ), _last( UINT64_MAX ) {}
+		
+		std::string	_file;		// Suffix of the source file, empty for an address range
+		uint64_t	_first;		// Lines or addresses, inclusive
+		uint64_t	_last;
+	};
+	
+	class SymbolResolver;
+
+	//=================================
+	
+	// Instances of a top-level region site in sampling mode. The work and the critical path are
+	// known only for the sampled instances, the counted work (busy time of the threads) for all.
+	struct SampleSite
+	{
+		SampleSite() : _numInstances( 0 ), _numSampled( 0 ), _countedWork( 0.0 ), _workSum( 0.0 ), 
+					   _workSqSum( 0.0 ), _spanSum( 0.0 ), _spanSqSum( 0.0 ) {}
+		
+		uint64_t	_numInstances;
+		uint64_t	_numSampled;
+		double		_countedWork;
+		double		_workSum;
+		double		_workSqSum;
+		double		_spanSum;
+		double		_spanSqSum;
+	};
+
+	//=================================
+
+	// The structure of repeated instances of a top-level parallel region is stored once: the types,
+	// sites and edges of the nodes. An instance keeps the nodes it is attached to, the node that
+	// stands for it in the graph and, in template order, the ids of its nodes and their threads,
+	// bounds and chunk counts as variable-length differences to the first instance, so that the
+	// chunks of dynamic loops may run on other threads, and the times of its nodes.
+	struct RegionTemplate
+	{
+		struct TemplateNode
+		{
+			Node::NodeType			_type;
+			uint32_t				_siteId;
+			uint64_t				_loopOffset;	// Loop id of a chunk relative to the first loop of the instance
+			unsigned int			_numPapiEvents;
+			bool					_fromEntry;		// Connected from the entry node
+			std::vector<int32_t>	_exits;			// Template indices, -1 is the sink node
+			
+			// Values of the first instance
+			int						_threadId;
+			int64_t					_lower;
+			int64_t					_upper;
+			unsigned int			_chunkCount;
+			int64_t					_iterCount;
+		};
+		
+		struct Instance
+		{
+			Node*		_entry;
+			Node*		_sink;
+			Node*		_summary;		// Connected from the entry node to the sink node, its time is the span
+			uint64_t	_firstLoop;
+			size_t		_packedOffset;	// Start of the instance in _packed and in _values
+			size_t		_valuesOffset;
+		};
+		
+		std::vector<TemplateNode>	_nodes;
+		int							_pathLength;	// Edges of the longest path between the nodes
+		std::vector<Instance>		_instances;
+		std::string					_packed;		// Ids, threads, bounds and chunk counts of the nodes
+		std::vector<double>			_values;		// Time of every node, tool time of chunks and longest chunk time of coalesced chunks
+		std::vector<long long>		_papiVals;
+	};
+	
 	class Graph {
 	public:
 		typedef std::map<int64_t, Node*>::iterator NodesIterator;
 	
-		Graph() {}
+		Graph() : _sites( 1, (const void*)NULL ), _siteSelected( 1, true ), _resolver( NULL ) {}
     
 		~Graph()
 		{
 			for( Graph::NodesIterator it = _graphNodes.begin(); it != _graphNodes.end(); ++it ) 
+			{
+				std::vector<Edge*>& exits = it->second->getExits();
+				for( size_t i = 0; i < exits.size(); ++i )
+					delete exits[i];
+				delete it->second;
+			}
+			for( std::vector<LoopInfo*>::iterator it = _loops.begin(); it != _loops.end(); ++it )
+				delete *it;
+			for( std::vector<SiteStatsTable*>::iterator it = _siteStats.begin(); it != _siteStats.end(); ++it )
+				delete *it;
+			for( std::vector<CallbackProfile*>::iterator it = _profiles.begin(); it != _profiles.end(); ++it )
+				delete *it;
+			for( std::unordered_map<std::string, RegionTemplate*>::iterator it = _templates.begin(); it != _templates.end(); ++it )
 				delete it->second;
+			deleteResolver();
 		}
     
 		void addNode( int64_t id, Node* node ) { _addMutex.lock(); _graphNodes[id] = node; _addMutex.unlock(); }
@@ -230,20 +503,145 @@ namespace libtdg
 		//Node* getNode( int64_t id ) { Node* node = NULL; _addMutex.lock(); node = _graphNodes[id]; _addMutex.unlock(); return node; }
     
 		std::map<int64_t, Node*>& getGraphNodes() { return _graphNodes; }
+		
+		LoopInfo* createLoop( const void* codeptr, uint32_t site_id, int sched, int64_t lower, int64_t upper,
+							  int64_t step, uint64_t chunk_size, unsigned int team_size );
+		
+		// Chunks refer to their loop by its index in the loops vector. In the graph of the run the
+		// loop ids are dense, so the id is also the index.
+		LoopInfo* getLoop( uint64_t id ) { return (id < _loops.size()) ? _loops[id] : NULL; }
+		
+		std::vector<LoopInfo*>& getLoops() { return _loops; }
+		
+		uint64_t getNumLoops() { _loopsMutex.lock(); uint64_t num_loops = _loops.size(); _loopsMutex.unlock(); return num_loops; }
+		
+		// Call sites (codeptr_ra) are interned to small ids, site 0 is the unknown site. If site filters
+		// are set, a new site is matched against them once and selected tells if it produces nodes.
+		uint32_t internSite( const void* codeptr, bool* selected = NULL );
+		
+		// Must be called before the first site is interned
+		void setSiteFilters( const std::vector<SiteFilter>& filters ) { _siteFilters = filters; _siteSelected[0] = filters.empty(); }
+		
+		unsigned int getNumSites() { return _sites.size(); }
+		
+		const void* getSiteCodeptr( uint32_t site_id ) { return (site_id < _sites.size()) ? _sites[site_id] : NULL; }
+		
+		// Returns "file:line" of the site. The sites are symbolized once, on the first call.
+		const std::string& getSiteName( uint32_t site_id );
+		
+		// Every thread collects the site statistics in its own table, the graph owns the tables
+		void registerSiteStats( SiteStatsTable* table ) { _sitesMutex.lock(); _siteStats.push_back( table ); _sitesMutex.unlock(); }
+		
+		std::vector<SiteStatsTable*>& getSiteStats() { return _siteStats; }
+		
+		// Every thread measures its callbacks in its own profile, in the order the threads registered
+		void registerCallbackProfile( CallbackProfile* profile ) { _sitesMutex.lock(); _profiles.push_back( profile ); _sitesMutex.unlock(); }
+		
+		std::vector<CallbackProfile*>& getCallbackProfiles() { return _profiles; }
     
 		void printDotFile( const std::string& file_name );
+		
+		void printDot( std::ostream& dot_stream, const std::string& graph_name = "" );
     
 		void topoSort( std::list<Node*>& topo_list );
+		
+		// Clears what the metrics store in the nodes (critical path and slack), so the metrics can
+		// run again on the same graph
+		void resetMetricState();
+		
+		// Removes zero-time pass-through nodes and redundant (transitive) edges. The work and
+		// the span of the graph do not change. Must be called when no callback is running.
+		// kept_nodes counts the pass-through nodes that are kept because bypassing them would add
+		// edges, and bounded_nodes the nodes whose search stopped after max_visits nodes.
+		void simplify( unsigned int max_visits, unsigned int& removed_nodes, unsigned int& removed_edges,
+					   unsigned int& kept_nodes, unsigned int& bounded_nodes );
+		
+		// Replaces the nodes of a completed region instance, which are reached from the exits of the
+		// entry node starting at first_exit and lead to the sink node, by an instance of a template.
+		// In the graph the instance becomes one node of the region site whose time is its span, which
+		// is also returned in span. Returns false and keeps the nodes if the instance has other connections.
+		bool foldInstance( Node* entry, size_t first_exit, Node* sink, uint64_t first_loop, uint32_t site_id,
+						   double* span = NULL );
+		
+		// Folded instances are numbered in the order they were folded
+		size_t getNumInstances() { _templatesMutex.lock(); size_t num_instances = _folded.size(); _templatesMutex.unlock(); return num_instances; }
+		
+		// Recreates the nodes of a folded instance, with their ids, in an empty graph, without the edges
+		// from the entry node and to the sink node. Returns the node that stands for the instance.
+		Node* expandInstance( size_t instance_id, Graph& instance );
+		
+		// Tells if the node stands for a folded instance, and its number
+		bool isInstanceNode( Node* node, size_t* instance_id = NULL );
+		
+		// Edges of the longest path between the nodes of the instance the node stands for
+		int getInstancePathLength( Node* node );
+		
+		// Moves the nodes of a completed region instance (see foldInstance) into an empty graph, without
+		// the edges from the entry node and to the sink node. Returns false and keeps the nodes if the
+		// instance has other connections.
+		bool extractInstance( Node* entry, size_t first_exit, Node* sink, Graph& region );
+		
+		// Recreates the nodes of all the folded instances in the graph, in place of the nodes that
+		// stand for them. Only the metrics that walk the whole graph need it.
+		void expandTemplates( unsigned int& num_templates, unsigned int& num_instances );
+		
+		// Work and critical path of the nodes of a completed region instance (see foldInstance)
+		void measureInstance( Node* entry, size_t first_exit, Node* sink, double& work, double& span );
+		
+		void recordSample( uint32_t site_id, bool sampled, double counted_work, double work, double span );
+		
+		std::map<uint32_t, SampleSite>& getSampleSites() { return _samples; }
+		
+		// Copies the nodes with ids below the watermark, the edges between them and the call sites
+		// into an empty graph. Can be called while the callbacks run, as long as the nodes below the
+		// watermark are final: their fields are read without locks, and only their edges, which can
+		// still be added to, are read under the node locks.
+		void copyNodesBelow( int64_t watermark, Graph& snapshot );
+		
+		// Copies the call sites and their names into another graph, resolving the new names here
+		void copySites( Graph& target );
+		
+		// Copies the loops of the chunks of another graph into it, which must hold no loops yet, in the
+		// order of their ids. The loops keep their ids and the chunks are set to their new index.
+		void copyLoops( Graph& target );
     
 		static void connectNodes( Node* source, Node* target );
 		
 		static void disconnectNodes( Node* source, Node* target );
     
 	private:
-		void visitNode( Node* curr_node, std::list<Node*>& topo_list );
-
+		static void removeEdge( Edge* edge );
+		
+		// Creates the nodes of an instance of the template and the edges between them. Folds may add to
+		// the vectors of the template, so the templates mutex must be held.
+		static void createInstanceNodes( RegionTemplate* tmpl, size_t idx, std::vector<Node*>& nodes );
+		
+		bool matchSiteFilters( const void* codeptr );
+		void deleteResolver();
+		
 		std::map<int64_t, Node*> _graphNodes;
 		std::mutex _addMutex;
+		
+		std::vector<LoopInfo*> _loops;
+		std::mutex _loopsMutex;
+		
+		std::vector<const void*> _sites;
+		std::vector<std::string> _siteNames;
+		std::unordered_map<const void*, uint32_t> _siteIds;
+		std::vector<SiteStatsTable*> _siteStats;
+		std::vector<CallbackProfile*> _profiles;
+		std::vector<SiteFilter> _siteFilters;
+		std::vector<bool> _siteSelected;
+		SymbolResolver* _resolver;		// Kept between the symbolizations, the line tables are decoded once
+		std::mutex _sitesMutex;
+		
+		std::unordered_map<std::string, RegionTemplate*> _templates;	// By shape
+		std::vector< std::pair<RegionTemplate*, size_t> > _folded;		// Template and index of every folded instance
+		std::unordered_map<Node*, size_t> _instanceNodes;				// Folded instance by the node that stands for it
+		std::mutex _templatesMutex;
+		
+		std::map<uint32_t, SampleSite> _samples;
+		std::mutex _samplesMutex;
 	};
 
 
@@ -19,15 +19,24 @@
 // SOFTWARE.
 
 #include <iostream>
+#include <fstream>
 #include <string>
 #include <algorithm>
 #include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
 #include <vector>
+#include <thread>
+#include <mutex>
 #include <timer.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <ompt.h>
 #include "callbacks.h"
 #include "metrics.h"
+#include "monitor.h"
 
 #ifdef HAVE_PAPI
 #include <papi.h>
@@ -36,11 +45,28 @@
 
 libtdg::Metric** g_metrics = NULL;
 
+// The snapshot thread waits on the semaphore, which the SIGUSR1 handler posts
+static std::thread			g_snapshotThread;
+static sem_t				g_snapshotSem;
+static double				g_snapshotInterval = 0.0;	// Seconds, 0 if only on SIGUSR1
+static double				g_startTime = 0.0;
+static std::atomic<bool>	g_snapshotStop( false );
+static bool					g_snapshotSignal = false;
+static struct sigaction		g_prevSigaction;
+static std::mutex			g_metricsMutex;				// Snapshots do not overlap a flush
+static std::thread			g_regionThread;				// Worker of TDG_REGION_FINALIZE
+static std::thread			g_monitorThread;			// Worker of TDG_MONITOR
+
 
 #define INIT_CALLBACK(func)																						\
 	if ( (*callback_set)( ompt_callback_##func, (ompt_callback_t)libtdg::cb_##func ) !=	ompt_set_always ) {		\
 		std::cout << "libtdg: cb_##func set failed" << std::endl;	}											\
 
+// Commands of ompt_control, same as omp_control_tool_t
+#define TDG_CONTROL_START	1
+#define TDG_CONTROL_PAUSE	2
+#define TDG_CONTROL_FLUSH	3
+
 #define INIT_CALLBACK_EXT(func)																					\
 	if ( (*callback_set)( ext_callback_##func, (ompt_callback_t)libtdg::cb_ext_##func ) != ompt_set_always ) {	\
 		std::cout << "libtdg: cb_##func set failed" << std::endl;	}											\
@@ -75,6 +101,61 @@ static void parse_tokens( const char* env_var, std::vector<std::string>& tokens_
 }
 
 
+static libtdg::InstrumentationLevel parse_level( const char* level_env )
+{
+	static const char* level_names[] = { "regions", "loops", "chunks", "tasks", "full" };
+	
+	if( level_env )
+	{
+		for( int level = libtdg::LEVEL_REGIONS; level <= libtdg::LEVEL_FULL; ++level )
+			if( std::string( level_env ) == level_names[level] )
+				return (libtdg::InstrumentationLevel)level;
+		
+		std::cerr << "libtdg: unknown TDG_LEVEL " << level_env << ", using full" << std::endl;
+	}
+	return libtdg::LEVEL_FULL;
+}
+
+
+// A filter is "file", "file:line", "file:first-last", "0xaddr" or "0xfirst-0xlast"
+static void parse_filters( const char* filter_env, std::vector<libtdg::SiteFilter>& filters )
+{
+	std::vector<std::string> tokens_v;
+	parse_tokens( filter_env, tokens_v );
+	
+	for( size_t i = 0; i < tokens_v.size(); ++i )
+	{
+		std::string& token = tokens_v[i];
+		libtdg::SiteFilter filter;
+		std::string range_str;
+		
+		if( token.compare( 0, 2, "0x" ) == 0 )
+		{
+			range_str = token;
+		}
+		else
+		{
+			size_t colon_pos = token.rfind( ':' );
+			filter._file = token.substr( 0, colon_pos );
+			if( colon_pos != std::string::npos )
+				range_str = token.substr( colon_pos + 1 );
+		}
+		
+		if( !range_str.empty() )
+		{
+			size_t dash_pos = range_str.find( '-' );
+			filter._first = std::strtoull( range_str.c_str(), NULL, 0 );
+			filter._last = (dash_pos == std::string::npos) ? filter._first : 
+							std::strtoull( range_str.c_str() + dash_pos + 1, NULL, 0 );
+		}
+		if( !token.empty() )
+			filters.push_back( filter );
+	}
+}
+
+static void control_libtdg( uint64_t command, uint64_t modifier );
+
+
 /*========================= Init =========================*/
 
 void init_papi_events()
@@ -120,11 +201,269 @@ void init_papi_events()
 #endif
 }
 
+// Creates the metric of a TDG_TOOL_METRICS token, NULL if the token is unknown. The names of the
+// files that the metric writes start with the prefix.
+static libtdg::Metric* create_metric( const std::string& token, const std::string& file_prefix = "" )
+{
+	if( token == "tim" )
+	{
+		return new libtdg::TotalTimeMetric( );
+	}
+	if( token == "cri" )
+	{
+		return new libtdg::CriticalPathMetric( );
+	}
+	if( token == "dot" )
+	{
+		return new libtdg::SimpleDotFileMetric( (file_prefix + "tdg.dot").c_str() );
+	}
+	if( token == "log" )
+	{
+		return new libtdg::LogFileMetric( (file_prefix + "chunks.log").c_str() );
+	}
+	if( token == "imb" )
+	{
+		return new libtdg::ImbalanceMetric( (file_prefix + "imbalance.log").c_str() );
+	}
+	if( token == "cost" )
+	{
+		const char* bins_env = std::getenv( "TDG_COST_BINS" );
+		unsigned int num_bins = bins_env ? std::max( 1, std::atoi( bins_env ) ) : 100;
+		return new libtdg::IterationCostMetric( (file_prefix + "cost.csv").c_str(), num_bins );
+	}
+	if( token == "sim" )
+	{
+		const char* overhead_env = std::getenv( "TDG_SIM_OVERHEAD" );
+		const char* instances_env = std::getenv( "TDG_SIM_INSTANCES" );
+		double overhead = overhead_env ? std::atof( overhead_env ) : 0.001;
+		unsigned int max_instances = instances_env ? std::max( 1, std::atoi( instances_env ) ) : 32;
+		return new libtdg::ScheduleSimMetric( (file_prefix + "schedule.csv").c_str(), overhead, max_instances );
+	}
+	if( token == "tcost" )
+	{
+		const char* threshold_env = std::getenv( "TDG_TOOL_COST_THRESHOLD" );
+		double threshold = threshold_env ? std::atof( threshold_env ) : 0.05;
+		return new libtdg::ToolCostMetric( (file_prefix + "tcost.csv").c_str(), threshold );
+	}
+	if( token == "site" )
+	{
+		return new libtdg::SiteMetric();
+	}
+	if( token == "slk" )
+	{
+		const char* pct_env = std::getenv( "TDG_SLACK_PCT" );
+		double slack_pct = pct_env ? std::atof( pct_env ) : 5.0;
+		return new libtdg::SlackMetric( (file_prefix + "slack.log").c_str(), slack_pct );
+	}
+	if( token == "kpath" )
+	{
+		const char* paths_env = std::getenv( "TDG_KPATHS" );
+		unsigned int num_paths = paths_env ? std::max( 1, std::atoi( paths_env ) ) : 10;
+		return new libtdg::KPathsMetric( (file_prefix + "paths.log").c_str(), num_paths );
+	}
+	if( token == "whatif" )
+	{
+		const char* speedup_env = std::getenv( "TDG_WHATIF_SPEEDUP" );
+		const char* check_env = std::getenv( "TDG_WHATIF_CHECK" );
+		double speedup = speedup_env ? std::atof( speedup_env ) : 2.0;
+		return new libtdg::WhatIfMetric( (speedup > 0.0) ? speedup : 2.0, check_env && std::atoi( check_env ) );
+	}
+	if( token == "smp" )
+	{
+		return new libtdg::SampleMetric();
+	}
+	if( token == "self" )
+	{
+		return new libtdg::SelfMetric();
+	}
+	return NULL;
+}
+
+// Writes the metrics of the completed top-level regions to snapshot.log (and the graph to
+// tdg.snapshot.dot with the dot metric). The graph is copied below the watermark while the
+// application keeps running, and the files are replaced only when they are complete. The
+// watermark also stops before the running node of the sequential code, whose time is not final.
+static void write_snapshot()
+{
+	std::lock_guard<std::mutex> lock( g_metricsMutex );
+	
+	libtdg::Graph snapshot;
+	int64_t watermark = std::min( libtdg::g_snapshotWatermark.load(), libtdg::g_serialNodeId.load() );
+	libtdg::g_tdg->copyNodesBelow( watermark, snapshot );
+	
+	std::ofstream log_file;
+	log_file.open( "snapshot.log.tmp" );
+	if( !log_file.is_open() )
+	{
+		std::cerr << "libtdg: error opening snapshot file snapshot.log.tmp" << std::endl;
+		return;
+	}
+	
+	log_file << "Snapshot at " << ftimer_msec() - g_startTime << " ms: " << snapshot.getGraphNodes().size() 
+			 << " nodes of the completed regions (ids below " << watermark << ")" << std::endl;
+	libtdg::TotalTimeMetric time_metric;
+	libtdg::CriticalPathMetric critical_metric;
+	time_metric.init( &snapshot );
+	critical_metric.init( &snapshot );
+	time_metric.printMetric( log_file );
+	critical_metric.printMetric( log_file );
+	log_file.close();
+	std::rename( "snapshot.log.tmp", "snapshot.log" );
+	
+	std::vector<std::string> tokens_v;
+	parse_tokens( std::getenv( "TDG_TOOL_METRICS" ), tokens_v );
+	if( std::find( tokens_v.begin(), tokens_v.end(), "dot" ) != tokens_v.end() )
+	{
+		snapshot.printDotFile( "tdg.snapshot.dot.tmp" );
+		std::rename( "tdg.snapshot.dot.tmp", "tdg.snapshot.dot" );
+	}
+}
+
+static void snapshot_signal_handler( int sig )
+{
+	sem_post( &g_snapshotSem );
+}
+
+static void snapshot_loop()
+{
+	while( true )
+	{
+		if( g_snapshotInterval > 0.0 )
+		{
+			struct timespec deadline;
+			clock_gettime( CLOCK_REALTIME, &deadline );
+			double nsec = deadline.tv_nsec + (g_snapshotInterval - (time_t)g_snapshotInterval) * 1e9;
+			deadline.tv_sec += (time_t)g_snapshotInterval + (time_t)(nsec / 1e9);
+			deadline.tv_nsec = (long)nsec % 1000000000L;
+			while( sem_timedwait( &g_snapshotSem, &deadline ) == -1 && errno == EINTR );
+		}
+		else
+		{
+			while( sem_wait( &g_snapshotSem ) == -1 && errno == EINTR );
+		}
+		if( g_snapshotStop )
+			break;
+		write_snapshot();
+	}
+}
+
+// SIGUSR1 is taken only if the application has not installed a handler for it
+static void init_snapshots()
+{
+	const char* snapshot_env = std::getenv( "TDG_SNAPSHOT" );
+	const char* interval_env = std::getenv( "TDG_SNAPSHOT_INTERVAL" );
+	g_snapshotInterval = interval_env ? std::max( 0.0, std::atof( interval_env ) ) : 0.0;
+	if( snapshot_env && !std::atoi( snapshot_env ) )
+		return;
+	
+	struct sigaction action;
+	sigaction( SIGUSR1, NULL, &g_prevSigaction );
+	g_snapshotSignal = (g_prevSigaction.sa_handler == SIG_DFL);
+	if( !g_snapshotSignal && g_snapshotInterval <= 0.0 )
+		return;
+	
+	sem_init( &g_snapshotSem, 0, 0 );
+	libtdg::g_snapshots = true;
+	g_snapshotThread = std::thread( snapshot_loop );
+	
+	if( g_snapshotSignal )
+	{
+		action.sa_handler = snapshot_signal_handler;
+		sigemptyset( &action.sa_mask );
+		action.sa_flags = SA_RESTART;
+		sigaction( SIGUSR1, &action, NULL );
+	}
+}
+
+static void stop_snapshots()
+{
+	if( !libtdg::g_snapshots )
+		return;
+	
+	if( g_snapshotSignal )
+		sigaction( SIGUSR1, &g_prevSigaction, NULL );
+	g_snapshotStop = true;
+	sem_post( &g_snapshotSem );
+	g_snapshotThread.join();
+	sem_destroy( &g_snapshotSem );
+}
+
+// Prints the metrics of every finalized top-level region instance to regions.log, and its graph
+// to regions.dot with the dot metric, then deletes its nodes. The files of the metrics are written
+// with the regions. prefix, one section per instance. The site, sample and self metrics describe the
+// whole run and are only computed at the end.
+static void region_finalize_loop()
+{
+	std::vector<std::string> tokens_v;
+	parse_tokens( std::getenv( "TDG_TOOL_METRICS" ), tokens_v );
+	bool print_dot = std::find( tokens_v.begin(), tokens_v.end(), "dot" ) != tokens_v.end();
+	
+	std::ofstream log_file;
+	std::ofstream dot_file;
+	log_file.open( "regions.log" );
+	if( print_dot )
+		dot_file.open( "regions.dot" );
+	if( !log_file.is_open() || (print_dot && !dot_file.is_open()) )
+	{
+		std::cerr << "libtdg: error opening regions.log or regions.dot" << std::endl;
+		exit( -2 );
+	}
+	
+	libtdg::FinalizedRegion region;
+	bool first_region = true;
+	while( libtdg::wait_finalized_region( region ) )
+	{
+		libtdg::g_tdg->copySites( *region._graph );
+		libtdg::g_tdg->copyLoops( *region._graph );
+		std::string section = "Region " + std::to_string( region._index ) + " (site " 
+							  + region._graph->getSiteName( region._site_id ) + ")";
+		log_file << section << ": " << region._graph->getGraphNodes().size() << " nodes, span (ms) " 
+				 << region._span << std::endl;
+		for( size_t i = 0; i < tokens_v.size(); ++i )
+		{
+			if( tokens_v[i] == "dot" || tokens_v[i] == "site" || tokens_v[i] == "smp" || tokens_v[i] == "self" )
+				continue;
+			libtdg::Metric* metric = create_metric( tokens_v[i], "regions." );
+			if( !metric )
+				continue;
+			metric->setFileSection( section, !first_region );
+			metric->init( region._graph );
+			metric->printMetric( log_file );
+			delete metric;
+		}
+		log_file.flush();
+		first_region = false;
+		
+		if( print_dot )
+		{
+			region._graph->printDot( dot_file, "region_" + std::to_string( region._index ) );
+			dot_file.flush();
+		}
+		delete region._graph;
+		libtdg::done_finalized_region();
+	}
+}
+
+// Measures the critical path of the completed top-level region instances that nothing else
+// measured, so that the application threads only queue them.
+static void monitor_loop()
+{
+	libtdg::MonitoredRegion region;
+	while( libtdg::wait_monitored_region( region ) )
+	{
+		double work = 0.0, span = 0.0;
+		libtdg::g_tdg->measureInstance( region._entry, region._first_exit, region._sink, work, span );
+		libtdg::g_monitor->_savedNs.fetch_add( (uint64_t)(std::max( 0.0, region._duration - span ) * 1e6) );
+		libtdg::done_monitored_region();
+	}
+}
+
 int init_libtdg( ompt_function_lookup_t lookup, ompt_fns_t* fns )
 {
 	std::cout << "libtdg: initialize..." << std::endl;
 	
 	ftimer_init();
+	g_startTime = ftimer_msec();
 	
 	libtdg::g_tdg = new libtdg::Graph();
 	libtdg::g_lookup = lookup;
@@ -136,24 +475,97 @@ int init_libtdg( ompt_function_lookup_t lookup, ompt_fns_t* fns )
 		exit( -1 );
 	}
 	
+	// The runtime does not call the callbacks that are not needed for the level
+	libtdg::g_level = parse_level( std::getenv( "TDG_LEVEL" ) );
+	
 	INIT_CALLBACK(thread_begin);
 	INIT_CALLBACK(thread_end);
 	INIT_CALLBACK(parallel_begin);
 	INIT_CALLBACK(parallel_end);
 	INIT_CALLBACK(implicit_task);
-	INIT_CALLBACK(work);
-	INIT_CALLBACK(task_schedule);
 	INIT_CALLBACK(task_create);
-	INIT_CALLBACK(task_dependences);
-	INIT_CALLBACK(task_dependence);
 	INIT_CALLBACK(sync_region);
+	if( libtdg::g_level >= libtdg::LEVEL_TASKS )
+	{
+		INIT_CALLBACK(task_schedule);
+		INIT_CALLBACK(task_dependences);
+		INIT_CALLBACK(task_dependence);
+		
+		// Optional, without it the wait at the end of a taskgroup is counted in the time of the task
+		(*callback_set)( ompt_callback_sync_region_wait, (ompt_callback_t)libtdg::cb_sync_region_wait );
+	}
+	if( libtdg::g_level >= libtdg::LEVEL_FULL )
+	{
+		INIT_CALLBACK(work);
+	}
+	
+	if ( (*callback_set)( ompt_event_control, (ompt_callback_t)control_libtdg ) != ompt_set_always ) {
+		std::cout << "libtdg: control callback set failed" << std::endl;	}
 	
 	// Extensions:
-	INIT_CALLBACK_EXT(loop);
-	INIT_CALLBACK_EXT(chunk);
+	if( libtdg::g_level >= libtdg::LEVEL_LOOPS )
+	{
+		INIT_CALLBACK_EXT(loop);
+	}
+	if( libtdg::g_level >= libtdg::LEVEL_CHUNKS )
+	{
+		INIT_CALLBACK_EXT(chunk);
+	}
 	
 	init_papi_events();
 	
+	const char* coalesce_env = std::getenv( "TDG_COALESCE" );
+	libtdg::g_coalesceTime = coalesce_env ? std::max( 0.0, std::atof( coalesce_env ) ) : 0.0;
+	
+	const char* templates_env = std::getenv( "TDG_TEMPLATES" );
+	libtdg::g_useTemplates = templates_env && std::atoi( templates_env );
+	
+	const char* sample_env = std::getenv( "TDG_SAMPLE" );
+	const char* seed_env = std::getenv( "TDG_SAMPLE_SEED" );
+	libtdg::g_sampleRate = sample_env ? std::max( 0.0, std::atof( sample_env ) ) : 0.0;
+	libtdg::g_sampleRng.seed( seed_env ? std::strtoul( seed_env, NULL, 10 ) : 1 );
+	
+	// Window of top-level parallel regions to capture, "first-last" (counted from 0, both optional)
+	const char* window_env = std::getenv( "TDG_CAPTURE_WINDOW" );
+	if( window_env )
+	{
+		std::string window_str = window_env;
+		size_t dash_pos = window_str.find( '-' );
+		std::string first_str = window_str.substr( 0, dash_pos );
+		std::string last_str = (dash_pos == std::string::npos) ? first_str : window_str.substr( dash_pos + 1 );
+		if( !first_str.empty() )
+			libtdg::g_captureFirst = std::strtoull( first_str.c_str(), NULL, 10 );
+		if( !last_str.empty() )
+			libtdg::g_captureLast = std::strtoull( last_str.c_str(), NULL, 10 );
+	}
+	
+	std::vector<libtdg::SiteFilter> filters;
+	parse_filters( std::getenv( "TDG_FILTER" ), filters );
+	libtdg::g_tdg->setSiteFilters( filters );
+	
+	const char* monitor_env = std::getenv( "TDG_MONITOR" );
+	if( monitor_env && std::atoi( monitor_env ) )
+	{
+		libtdg::g_monitor = libtdg::create_monitor_segment();
+		g_monitorThread = std::thread( monitor_loop );
+	}
+	
+	init_snapshots();
+	
+	// The callbacks are measured only for the self metric
+	std::vector<std::string> metric_tokens;
+	parse_tokens( std::getenv( "TDG_TOOL_METRICS" ), metric_tokens );
+	libtdg::g_selfProfile = std::find( metric_tokens.begin(), metric_tokens.end(), "self" ) != metric_tokens.end();
+	
+	// Completed top-level region instances are printed and deleted by a worker
+	const char* finalize_env = std::getenv( "TDG_REGION_FINALIZE" );
+	libtdg::g_regionFinalize = finalize_env && std::atoi( finalize_env );
+	if( libtdg::g_regionFinalize )
+		g_regionThread = std::thread( region_finalize_loop );
+	
+	const char* governor_env = std::getenv( "TDG_GOVERNOR" );
+	libtdg::g_overheadBudget = governor_env ? std::max( 0.0, std::atof( governor_env ) ) : 0.0;
+	
 	// Lookup additional functions:
 	libtdg::g_get_thread_data_f = (ompt_get_thread_data_t)(*lookup)( "ompt_get_thread_data" );
 	if( !libtdg::g_get_thread_data_f )
@@ -165,16 +577,11 @@ int init_libtdg( ompt_function_lookup_t lookup, ompt_fns_t* fns )
 	return 1;
 }
 
-void finalize_libtdg( ompt_fns_t* fns )
+// Computes and prints the metrics of the graph captured so far. On a flush the graph is still in use,
+// so it is not simplified: the nodes that the open regions point to must stay.
+static void run_metrics( bool flush )
 {
-#ifdef LIBTDG_TRACE
-	std::cout << "libtdg: finalize..." << std::endl;
-#endif
-	
-	if( libtdg::g_finalNode )
-		libtdg::g_finalNode->addTime( ftimer_msec() );
-	
-	// Possible metrics: tim,cri,dot
+	// Possible metrics: tim,cri,dot,log,imb,cost,sim,tcost,site,slk,kpath,whatif,smp,self
 	const char* metrics_env = std::getenv( "TDG_TOOL_METRICS" );
 	unsigned int num_metrics = 0;
 	std::vector<std::string> tokens_v;
@@ -187,40 +594,131 @@ void finalize_libtdg( ompt_fns_t* fns )
 	std::cout << "libtdg: num tool metrics: " << num_metrics << std::endl;
 #endif
 
+	// Simplification and the metrics that walk the whole graph need the nodes of the folded instances,
+	// the other metrics expand the instances one at a time
+	const char* simplify_env = std::getenv( "TDG_SIMPLIFY" );
+	bool simplify = !flush && simplify_env && std::atoi( simplify_env );
+	bool expand_templates = simplify;
+	for( unsigned int i = 0; i < num_metrics; ++i )
+		expand_templates |= (tokens_v[i] == "dot" || tokens_v[i] == "slk" || tokens_v[i] == "kpath");
+	if( expand_templates )
+	{
+		unsigned int num_templates, num_instances;
+		libtdg::g_tdg->expandTemplates( num_templates, num_instances );
+		if( num_instances )
+		{
+			std::cout << "libtdg: expanded " << num_instances << " region instances of " 
+					  << num_templates << " templates" << std::endl;
+		}
+	}
+
+	if( simplify )
+	{
+		const char* max_visits_env = std::getenv( "TDG_SIMPLIFY_MAX_VISITS" );
+		unsigned int max_visits = max_visits_env ? std::max( 1, std::atoi( max_visits_env ) ) : SIMPLIFY_MAX_VISITS;
+		unsigned int removed_nodes, removed_edges, kept_nodes, bounded_nodes;
+		libtdg::g_tdg->simplify( max_visits, removed_nodes, removed_edges, kept_nodes, bounded_nodes );
+		std::cout << "libtdg: simplified graph, removed " << removed_nodes << " nodes and "
+				  << removed_edges << " edges" << std::endl;
+		if( kept_nodes )
+		{
+			std::cout << "libtdg: kept " << kept_nodes << " pass-through nodes, bypassing them would add edges" 
+					  << std::endl;
+		}
+		if( bounded_nodes )
+		{
+			std::cout << "libtdg: the search for redundant edges reached its bound of " << max_visits 
+					  << " visited nodes at " << bounded_nodes << " nodes, some redundant edges may be kept"
+					  << " (see TDG_SIMPLIFY_MAX_VISITS)" << std::endl;
+		}
+	}
+
+	libtdg::g_tdg->resetMetricState();
 	if( num_metrics )
 	{
 		g_metrics = new libtdg::Metric*[num_metrics];
 		for( int i = 0; i < num_metrics; ++i )
-		{
-			std::string& token = tokens_v[i];
-			
-			if( token == "tim" )
-			{
-				g_metrics[i] = new libtdg::TotalTimeMetric( );
-			}
-			if( token == "cri" )
-			{
-				g_metrics[i] = new libtdg::CriticalPathMetric( );
-			}
-			if( token == "dot" )
-			{
-				g_metrics[i] = new libtdg::SimpleDotFileMetric( "tdg.dot" );
-			}
-			if( token == "log" )
-			{
-				g_metrics[i] = new libtdg::LogFileMetric( "chunks.log" );
-			}
-		}
+			g_metrics[i] = create_metric( tokens_v[i] );
 	}
 			
 	for( unsigned int i = 0; i < num_metrics; ++i )
-		g_metrics[i]->init( libtdg::g_tdg );
+		if( g_metrics[i] )
+			g_metrics[i]->init( libtdg::g_tdg );
 		
 	for( unsigned int i = 0; i < num_metrics; ++i )
-		g_metrics[i]->printMetric( std::cout );
+		if( g_metrics[i] )
+			g_metrics[i]->printMetric( std::cout );
 		
 	for( unsigned int i = 0; i < num_metrics; ++i )
 		delete g_metrics[i];
+	
+	delete[] g_metrics;
+	g_metrics = NULL;
+}
+
+// Commands of ompt_control, with the values of omp_control_tool. Start and pause take effect at
+// the next top-level region, the running one is captured or not as it began. Flush prints the metrics of
+// what was captured so far and must be called from sequential code; it first waits for the
+// completed top-level regions to settle.
+static void control_libtdg( uint64_t command, uint64_t modifier )
+{
+	switch( command )
+	{
+		case TDG_CONTROL_START:
+			libtdg::g_captureOn = true;
+			break;
+		case TDG_CONTROL_PAUSE:
+			libtdg::g_captureOn = false;
+			break;
+		case TDG_CONTROL_FLUSH:
+			if( libtdg::g_inTopRegion )
+			{
+				std::cerr << "libtdg: flush inside a parallel region is ignored" << std::endl;
+				break;
+			}
+			libtdg::wait_settled_regions();
+			if( libtdg::g_finalNode && libtdg::g_capturing )
+				libtdg::g_finalNode->addTime( ftimer_msec() );
+			std::cout << "libtdg: flush..." << std::endl;
+			g_metricsMutex.lock();
+			run_metrics( true );
+			g_metricsMutex.unlock();
+			break;
+		default:
+			break;
+	}
+}
+
+void finalize_libtdg( ompt_fns_t* fns )
+{
+#ifdef LIBTDG_TRACE
+	std::cout << "libtdg: finalize..." << std::endl;
+#endif
+	
+	if( libtdg::g_finalNode && libtdg::g_capturing )
+		libtdg::g_finalNode->addTime( ftimer_msec() );
+	
+	stop_snapshots();
+	
+	if( libtdg::g_regionFinalize )
+	{
+		libtdg::stop_finalized_regions();
+		g_regionThread.join();
+	}
+	
+	if( libtdg::g_monitor )
+	{
+		libtdg::stop_monitored_regions();
+		g_monitorThread.join();
+	}
+	
+	if( libtdg::g_overheadBudget > 0.0 )
+		libtdg::print_governor( std::cout );
+
+	run_metrics( false );
+	
+	if( libtdg::g_monitor )
+		libtdg::destroy_monitor_segment( libtdg::g_monitor );
 
 	delete[] libtdg::g_papiEvents;
 	delete libtdg::g_tdg;
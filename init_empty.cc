@@ -63,6 +63,7 @@ int init_libtdg( ompt_function_lookup_t lookup, ompt_fns_t* fns )
 	INIT_CALLBACK(task_dependences);
 	INIT_CALLBACK(task_dependence);
 	INIT_CALLBACK(sync_region);
+	INIT_CALLBACK(sync_region_wait);
 	
 	// Extensions:
 	INIT_CALLBACK_EXT(loop);
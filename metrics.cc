@@ -22,6 +22,12 @@
 #include <fstream>
 #include <iostream>
 #include <algorithm>
+#include <queue>
+#include <functional>
+#include <cmath>
+#include <unordered_map>
+#include <timer.h>
+#include <ompt.h>
 #include "metrics.h"
 
 
@@ -31,6 +37,40 @@ using namespace libtdg;
 extern void compute_stats( std::vector<double>& arr, double& total, double& avg, double& stddev, double& median );
 
 
+//========================== NodeWalker ================================
+
+Node* NodeWalker::next()
+{
+	while( true )
+	{
+		std::map<int64_t, Node*>& graph_nodes = _instance ? _instance->getGraphNodes() : _tdg->getGraphNodes();
+		while( _it != graph_nodes.end() )
+		{
+			Node* curr_node = (_it++)->second;
+			if( _instance || !_tdg->isInstanceNode( curr_node ) )
+				return curr_node;
+		}
+		
+		if( _nextInstance == _tdg->getNumInstances() )
+			return NULL;
+		delete _instance;
+		_instance = new Graph;
+		_tdg->expandInstance( _nextInstance++, *_instance );
+		_it = _instance->getGraphNodes().begin();
+	}
+}
+
+
+//============================ Metric ==================================
+
+void Metric::openFile( std::ofstream& file, const std::string& file_name )
+{
+	file.open( file_name.c_str(), _appendFile ? std::ios::app : std::ios::out );
+	if( file.is_open() && !_fileSection.empty() )
+		file << "# " << _fileSection << std::endl;
+}
+
+
 //===================== CriticalPathMetric =============================
 
 double CriticalPathMetric::getMetric( ) 
@@ -48,6 +88,33 @@ void CriticalPathMetric::printMetric( std::ostream& out_stream )
 	
 	out_stream << "Longest (critical) path (time ms): " << _critical_path_time_len << std::endl;
 	out_stream << "Longest (critical) path (length): " << _critical_path_len << std::endl;
+	
+	double total_time = 0.0;
+	for( unsigned int i = 0; i < _typeTimes.size(); ++i )
+		total_time += _typeTimes[i];
+	
+	out_stream << "Critical path by node type:" << std::endl;
+	for( unsigned int i = 0; i < _typeTimes.size(); ++i )
+	{
+		if( _typeCounts[i] == 0 )
+			continue;
+		out_stream << "  " << Node::typeToStr( (Node::NodeType)i ) << ": time (ms) " << _typeTimes[i]
+		           << " (" << ((total_time > 0.0) ? (100.0 * _typeTimes[i] / total_time) : 0.0) << "%)"
+		           << ", nodes " << _typeCounts[i] << std::endl;
+	}
+	
+	std::vector< std::pair<double, uint32_t> > sites;
+	for( std::map< uint32_t, std::pair<double, int> >::const_iterator it = _siteTimes.begin(); it != _siteTimes.end(); ++it )
+		sites.push_back( std::make_pair( it->second.first, it->first ) );
+	std::sort( sites.begin(), sites.end(), std::greater< std::pair<double, uint32_t> >() );
+	
+	out_stream << "Critical path by call site:" << std::endl;
+	for( unsigned int i = 0; i < sites.size(); ++i )
+	{
+		out_stream << "  " << _tdg->getSiteName( sites[i].second ) << ": time (ms) " << sites[i].first
+		           << " (" << ((total_time > 0.0) ? (100.0 * sites[i].first / total_time) : 0.0) << "%)"
+		           << ", nodes " << _siteTimes[sites[i].second].second << std::endl;
+	}
 }
 
 
@@ -71,6 +138,17 @@ void CriticalPathMetric::computeCriticalPath( )
 	std::cerr << std::endl;
 	***/
 		
+	Node* last_critical_node = scanPaths( topo_list, _critical_path_time_len, _critical_path_len );
+	
+	std::cerr << "CriticalPathMetric - marking critical nodes" << std::endl;
+	double total_time_on_criticial_path = addPath( last_critical_node );
+	std::cerr << "CriticalPathMetric - total time on critical path: " << total_time_on_criticial_path << std::endl;
+	std::cerr << "CriticalPathMetric - finished the critical path computation" << std::endl;
+}
+
+
+Node* CriticalPathMetric::scanPaths( std::list<Node*>& topo_list, double& path_time, int& path_len )
+{
 	Node* last_critical_node = NULL;
       
 	//std::cerr << "CriticalPathMetric - scanning nodes:" << std::endl;
@@ -79,7 +157,7 @@ void CriticalPathMetric::computeCriticalPath( )
 		Node* curr_node = *l_iter;
 		//if (curr_node->ignore_node_for_metrics ())
 		//	continue;
-		double max_curr_path_time = curr_node->getTotalTime();
+		double max_curr_path_time = curr_node->getSpanTime();
 		int max_curr_path_len = 0;
 		Node::AdjacencyIterator adj_iter = 
 			Node::AdjacencyIterator::beginAdjIter (curr_node, true);     // Iterate over entry edges
@@ -93,7 +171,7 @@ void CriticalPathMetric::computeCriticalPath( )
 				max_curr_path_len = path_inc;
 				//curr_node->_prev_critical = source_node;
 			}
-			double time_inc = source_node->getPathTime() + curr_node->getTotalTime();
+			double time_inc = source_node->getPathTime() + curr_node->getSpanTime();
 			if( time_inc > max_curr_path_time ) 
 			{
 				max_curr_path_time = time_inc;
@@ -101,31 +179,70 @@ void CriticalPathMetric::computeCriticalPath( )
 			}
 			++adj_iter;
 		}
+		
+		// The node of a folded instance stands for the paths between the nodes of the instance
+		max_curr_path_len += _tdg->getInstancePathLength( curr_node );
 		curr_node->setPathLength( max_curr_path_len );
 		curr_node->setPathTime( max_curr_path_time );
 			
 		//std::cerr << "Curr node: " << curr_node->get_wd_id () << ", path length: " << curr_node->_path_length << std::endl;
 		//std::cerr << max_curr_path_len << "   " << max_curr_path_time << std::endl;
 		
-		if (max_curr_path_len > _critical_path_len) {
-			_critical_path_len = max_curr_path_len;
+		if (max_curr_path_len > path_len) {
+			path_len = max_curr_path_len;
 			//last_critical_node = curr_node;
 		}
-		if (max_curr_path_time > _critical_path_time_len) {
-			_critical_path_time_len = max_curr_path_time;
+		if (max_curr_path_time > path_time) {
+			path_time = max_curr_path_time;
 			last_critical_node = curr_node;
 		}
 	}
 	
-	std::cerr << "CriticalPathMetric - marking critical nodes" << std::endl;
-	double total_time_on_criticial_path = 0.0;
-	while (last_critical_node) {
-		last_critical_node->setIsCritical( true );
-		total_time_on_criticial_path += last_critical_node->getTotalTime();
-		last_critical_node = last_critical_node->getPrevCritical();
+	return last_critical_node;
+}
+
+
+double CriticalPathMetric::addPath( Node* last_node )
+{
+	double total_time = 0.0;
+	size_t instance_id;
+	while (last_node) {
+		last_node->setIsCritical( true );
+		
+		// The span of a folded instance is the longest path between its nodes. The path goes on to
+		// the sink node, so it ends in a node without exits.
+		if( _tdg->isInstanceNode( last_node, &instance_id ) )
+		{
+			Graph instance;
+			_tdg->expandInstance( instance_id, instance );
+			std::list<Node*> topo_list;
+			instance.topoSort( topo_list );
+			double path_time = 0.0;
+			int path_len = 0;
+			scanPaths( topo_list, path_time, path_len );
+			
+			Node* instance_last = NULL;
+			for( std::list<Node*>::iterator it = topo_list.begin(); it != topo_list.end(); ++it )
+			{
+				if( (*it)->getExits().empty() && (!instance_last || (*it)->getPathTime() > instance_last->getPathTime()) )
+					instance_last = *it;
+			}
+			total_time += addPath( instance_last );
+		}
+		else
+		{
+			total_time += last_node->getSpanTime();
+			_typeTimes[last_node->getType()] += last_node->getSpanTime();
+			_typeCounts[last_node->getType()]++;
+			std::pair<double, int>& site_time = _siteTimes[last_node->getSiteId()];
+			site_time.first += last_node->getSpanTime();
+			site_time.second++;
+		}
+		
+		last_node = last_node->getPrevCritical();
 	}
-	std::cerr << "CriticalPathMetric - total time on critical path: " << total_time_on_criticial_path << std::endl;
-	std::cerr << "CriticalPathMetric - finished the critical path computation" << std::endl;
+	
+	return total_time;
 }
 
 
@@ -135,20 +252,18 @@ void TotalTimeMetric::init( Graph* tdg )
 {
 	Metric::init( tdg );
 	
-	std::map<int64_t, Node*>& graph_nodes = _tdg->getGraphNodes();
+	NodeWalker walker( _tdg );
 	
 	_nodes_total_time = 0;
-	for( std::map<int64_t, Node*>::const_iterator it = graph_nodes.begin(); 
-		 it != graph_nodes.end(); ++it ) 
+	for( Node* curr_node = walker.next(); curr_node; curr_node = walker.next() )
 	{
-		Node* curr_node = it->second;
 		//if (curr_node->ignore_node_for_metrics ())
 		//	continue;
 		_node_times_arr.push_back( curr_node->getTotalTime() );
 		
 		if( curr_node->getType() == Node::CHUNK_TASK )
 		{
-			_numChunks++;
+			_numChunks += curr_node->getChunkCount();
 			_totalChunkTimes += curr_node->getTotalTime();
 		}
 		
@@ -185,12 +300,81 @@ void TotalTimeMetric::printMetric( std::ostream& out_stream )
 	}
 }
 
-//======================= LogFileMetric ==============================
+//======================= ImbalanceMetric ==============================
 
-void LogFileMetric::printMetric( std::ostream& out_stream )
+void ImbalanceMetric::init( Graph* tdg )
+{
+	Metric::init( tdg );
+	
+	std::vector<LoopInfo*>& loops = _tdg->getLoops();
+	std::vector<LoopImbalance> loop_imbs( loops.size() );
+	
+	NodeWalker walker( _tdg );
+	for( Node* curr_node = walker.next(); curr_node; curr_node = walker.next() )
+	{
+		if( curr_node->getType() == Node::CHUNK_TASK && curr_node->getLoopCounter() < loop_imbs.size() )
+		{
+			LoopImbalance& loop_imb = loop_imbs[curr_node->getLoopCounter()];
+			unsigned int thread_id = curr_node->getThreadId();
+			if( thread_id >= loop_imb._busyTimes.size() )
+			{
+				loop_imb._busyTimes.resize( thread_id + 1, 0.0 );
+				loop_imb._numChunks.resize( thread_id + 1, 0 );
+			}
+			loop_imb._busyTimes[thread_id] += curr_node->getTotalTime();
+			loop_imb._numChunks[thread_id] += curr_node->getChunkCount();
+		}
+	}
+	
+	// Loop instances are grouped by the call site of the loop construct
+	std::map<uint32_t, SiteImbalance> sites_map;
+	
+	_totalWastedTime = 0.0;
+	for( unsigned int i = 0; i < loop_imbs.size(); ++i )
+	{
+		LoopImbalance& loop_imb = loop_imbs[i];
+		if( loop_imb._busyTimes.empty() )
+			continue;
+		
+		// Threads of the team that executed no chunks are idle for the whole loop
+		loop_imb._loop = loops[i];
+		unsigned int num_threads = std::max( (unsigned int)loop_imb._busyTimes.size(), loop_imb._loop->getTeamSize() );
+		loop_imb._busyTimes.resize( num_threads, 0.0 );
+		loop_imb._numChunks.resize( num_threads, 0 );
+		
+		double total_busy = 0.0;
+		for( unsigned int t = 0; t < num_threads; ++t )
+		{
+			total_busy += loop_imb._busyTimes[t];
+			loop_imb._maxBusy = std::max( loop_imb._maxBusy, loop_imb._busyTimes[t] );
+		}
+		loop_imb._meanBusy = total_busy / num_threads;
+		loop_imb._wastedTime = loop_imb._maxBusy * num_threads - total_busy;
+		_totalWastedTime += loop_imb._wastedTime;
+		
+		double ratio = (loop_imb._meanBusy > 0.0) ? (loop_imb._maxBusy / loop_imb._meanBusy) : 1.0;
+		SiteImbalance& site_imb = sites_map[loop_imb._loop->getSiteId()];
+		site_imb._siteId = loop_imb._loop->getSiteId();
+		site_imb._numInstances++;
+		site_imb._totalTime += loop_imb._maxBusy;
+		site_imb._parallelTime += loop_imb._maxBusy * num_threads;
+		site_imb._wastedTime += loop_imb._wastedTime;
+		site_imb._sumRatio += ratio;
+		site_imb._maxRatio = std::max( site_imb._maxRatio, ratio );
+		
+		_loops.push_back( loop_imb );
+	}
+	
+	for( std::map<uint32_t, SiteImbalance>::const_iterator it = sites_map.begin(); it != sites_map.end(); ++it )
+		_sites.push_back( it->second );
+	std::sort( _sites.begin(), _sites.end(), compareWastedTime );
+}
+
+
+void ImbalanceMetric::printMetric( std::ostream& out_stream )
 {
 	std::ofstream log_file;
-	log_file.open( _logFilename.c_str() );
+	openFile( log_file, _logFilename );
 	
 	if( !log_file.is_open() ) 
 	{
@@ -198,22 +382,1220 @@ void LogFileMetric::printMetric( std::ostream& out_stream )
 		exit( -2 );
 	}
 	
-	std::map<int64_t, Node*>& graph_nodes = _tdg->getGraphNodes();
+	for( std::vector<LoopImbalance>::const_iterator it = _loops.begin(); it != _loops.end(); ++it )
+	{
+		double max_over_mean = (it->_meanBusy > 0.0) ? (it->_maxBusy / it->_meanBusy) : 1.0;
+		double parallel_time = it->_maxBusy * it->_busyTimes.size();
+		
+		log_file << "loop " << it->_loop->getId() 
+		         << "  site " << _tdg->getSiteName( it->_loop->getSiteId() )
+		         << "  threads " << it->_busyTimes.size()
+		         << "  max " << it->_maxBusy
+		         << "  mean " << it->_meanBusy
+		         << "  max/mean " << max_over_mean
+		         << "  wasted " << it->_wastedTime
+		         << " (" << ((parallel_time > 0.0) ? (100.0 * it->_wastedTime / parallel_time) : 0.0) << "%)" << std::endl;
+		for( unsigned int t = 0; t < it->_busyTimes.size(); ++t )
+		{
+			log_file << "  thread " << t << "  busy " << it->_busyTimes[t] << "  chunks " << it->_numChunks[t] << std::endl;
+		}
+	}
+	
+	log_file.close();
+	
+	out_stream << "Loop instances: " << _loops.size() << std::endl;
+	out_stream << "Total wasted parallel time in loops (ms): " << _totalWastedTime << std::endl;
+	for( std::vector<SiteImbalance>::const_iterator it = _sites.begin(); it != _sites.end(); ++it )
+	{
+		out_stream << "Loop site " << _tdg->getSiteName( it->_siteId ) << ": "
+		           << "instances " << it->_numInstances
+		           << ", time (ms) " << it->_totalTime
+		           << ", wasted (ms) " << it->_wastedTime
+		           << " (" << ((it->_parallelTime > 0.0) ? (100.0 * it->_wastedTime / it->_parallelTime) : 0.0) << "%)"
+		           << ", avg max/mean " << (it->_sumRatio / it->_numInstances)
+		           << ", max max/mean " << it->_maxRatio << std::endl;
+	}
+}
+
+//===================== IterationCostMetric ============================
+
+void IterationCostMetric::init( Graph* tdg )
+{
+	Metric::init( tdg );
+	
+	std::vector<LoopInfo*>& loops = _tdg->getLoops();
+	std::map<uint32_t, unsigned int> site_idx_map;
+	std::vector<unsigned int> loop_site_idx( loops.size() );
+	
+	// The loops without chunks, such as those of the finalized regions (TDG_REGION_FINALIZE), are left out
+	std::vector<bool> loop_has_chunks( loops.size(), false );
+	NodeWalker chunk_walker( _tdg );
+	for( Node* curr_node = chunk_walker.next(); curr_node; curr_node = chunk_walker.next() )
+	{
+		if( curr_node->getType() == Node::CHUNK_TASK && curr_node->getLoopCounter() < loops.size() )
+			loop_has_chunks[curr_node->getLoopCounter()] = true;
+	}
+	
+	// First pass: the iteration space of each call site is the union over its instances
+	for( unsigned int i = 0; i < loops.size(); ++i )
+	{
+		if( !loop_has_chunks[i] )
+			continue;
+		LoopInfo* loop = loops[i];
+		int64_t min_iter = std::min( loop->getLower(), loop->getUpper() );
+		int64_t max_iter = std::max( loop->getLower(), loop->getUpper() );
+		
+		std::map<uint32_t, unsigned int>::iterator site_it = site_idx_map.find( loop->getSiteId() );
+		if( site_it == site_idx_map.end() )
+		{
+			site_it = site_idx_map.insert( std::make_pair( loop->getSiteId(), _profiles.size() ) ).first;
+			_profiles.push_back( SiteCostProfile() );
+			SiteCostProfile& profile = _profiles.back();
+			profile._siteId = loop->getSiteId();
+			profile._minIter = min_iter;
+			profile._maxIter = max_iter;
+			profile._stride = std::max( (int64_t)1, (int64_t)std::abs( loop->getStep() ) );
+		}
+		
+		SiteCostProfile& profile = _profiles[site_it->second];
+		profile._minIter = std::min( profile._minIter, min_iter );
+		profile._maxIter = std::max( profile._maxIter, max_iter );
+		profile._numInstances++;
+		loop_site_idx[i] = site_it->second;
+	}
+	
+	for( std::vector<SiteCostProfile>::iterator it = _profiles.begin(); it != _profiles.end(); ++it )
+	{
+		// Bins hold a whole number of iterations
+		int64_t num_iters = (it->_maxIter - it->_minIter) / it->_stride + 1;
+		int64_t bin_iters = (num_iters + _maxBins - 1) / _maxBins;
+		unsigned int num_bins = (num_iters + bin_iters - 1) / bin_iters;
+		it->_binWidth = (double)(bin_iters * it->_stride);
+		it->_binIters.resize( num_bins, 0.0 );
+		it->_binCosts.resize( num_bins, 0.0 );
+	}
+	
+	// Second pass: spread the time of each chunk uniformly over its iterations
+	NodeWalker walker( _tdg );
+	for( Node* curr_node = walker.next(); curr_node; curr_node = walker.next() )
+	{
+		if( curr_node->getType() == Node::CHUNK_TASK && curr_node->getLoopCounter() < loops.size() )
+		{
+			addChunk( _profiles[loop_site_idx[curr_node->getLoopCounter()]], 
+					  curr_node->getLower(), curr_node->getUpper(), curr_node->getIterCount(), curr_node->getTotalTime() );
+		}
+	}
+}
+
+
+void IterationCostMetric::addChunk( SiteCostProfile& profile, int64_t lower, int64_t upper, int64_t num_iters, double time )
+{
+	// Every iteration occupies the interval [i, i + stride) of the loop variable values
+	double chunk_begin = (double)(std::min( lower, upper ) - profile._minIter);
+	double chunk_end = (double)(std::max( lower, upper ) - profile._minIter + profile._stride);
+	
+	// Coalesced chunks cover only a part of the iterations in their span
+	double span_iters = (chunk_end - chunk_begin) / profile._stride;
+	double fill = (num_iters > 0) ? std::min( 1.0, num_iters / span_iters ) : 1.0;
+	double iter_cost = time / (span_iters * fill);
+	
+	unsigned int num_bins = profile._binCosts.size();
+	unsigned int first_bin = std::min( (unsigned int)std::max( 0.0, chunk_begin / profile._binWidth ), num_bins - 1 );
+	for( unsigned int b = first_bin; b < num_bins; ++b )
+	{
+		double bin_begin = b * profile._binWidth;
+		if( bin_begin >= chunk_end )
+			break;
+		double overlap = std::min( chunk_end, bin_begin + profile._binWidth ) - std::max( chunk_begin, bin_begin );
+		if( overlap <= 0.0 )
+			continue;
+		profile._binIters[b] += overlap / profile._stride * fill;
+		profile._binCosts[b] += overlap / profile._stride * fill * iter_cost;
+	}
+}
+
+
+void IterationCostMetric::printMetric( std::ostream& out_stream )
+{
+	std::ofstream csv_file;
+	openFile( csv_file, _csvFilename );
+	
+	if( !csv_file.is_open() ) 
+	{
+		std::cerr << "libtdg: error opening csv file " << _csvFilename << std::endl;
+		exit( -2 );
+	}
+	
+	csv_file << "site,bin,lower,upper,iterations,cost_ms,cost_per_iter_ms" << std::endl;
+	for( std::vector<SiteCostProfile>::const_iterator it = _profiles.begin(); it != _profiles.end(); ++it )
+	{
+		double min_cost = -1.0, max_cost = 0.0, total_cost = 0.0, total_iters = 0.0;
+		
+		for( unsigned int b = 0; b < it->_binCosts.size(); ++b )
+		{
+			int64_t bin_lower = it->_minIter + (int64_t)(b * it->_binWidth);
+			int64_t bin_upper = std::min( it->_maxIter, bin_lower + (int64_t)it->_binWidth - it->_stride );
+			double iter_cost = (it->_binIters[b] > 0.0) ? (it->_binCosts[b] / it->_binIters[b]) : 0.0;
+			
+			csv_file << _tdg->getSiteName( it->_siteId ) << "," << b << "," << bin_lower << "," << bin_upper << ","
+			         << it->_binIters[b] << "," << it->_binCosts[b] << "," << iter_cost << std::endl;
+			
+			if( it->_binIters[b] > 0.0 )
+			{
+				min_cost = (min_cost < 0.0) ? iter_cost : std::min( min_cost, iter_cost );
+				max_cost = std::max( max_cost, iter_cost );
+			}
+			total_cost += it->_binCosts[b];
+			total_iters += it->_binIters[b];
+		}
+		
+		out_stream << "Loop site " << _tdg->getSiteName( it->_siteId ) << ": "
+		           << "instances " << it->_numInstances
+		           << ", iterations [" << it->_minIter << ", " << it->_maxIter << "]"
+		           << ", bins " << it->_binCosts.size()
+		           << ", avg cost/iter (ms) " << ((total_iters > 0.0) ? (total_cost / total_iters) : 0.0)
+		           << ", min bin cost/iter " << std::max( min_cost, 0.0 )
+		           << ", max bin cost/iter " << max_cost << std::endl;
+	}
+	
+	csv_file.close();
+}
+
+//====================== ScheduleSimMetric =============================
+
+// Max number of chunks in a simulated loop instance; configs above it are not simulated
+#define SIM_MAX_DISPATCHES		(1 << 22)
+
+static const char* sim_sched_names[] = { "static", "dynamic", "guided" };
+
+
+double ScheduleSimMetric::CostModel::prefixCost( int64_t iter ) const
+{
+	std::vector<int64_t>::const_iterator seg_it = std::upper_bound( _segBegin.begin(), _segBegin.end(), iter );
+	if( seg_it == _segBegin.begin() )
+		return 0.0;
+	
+	unsigned int seg = (seg_it - _segBegin.begin()) - 1;
+	return _segPrefixCost[seg] + (std::min( iter, _segEnd[seg] ) - _segBegin[seg]) * _segIterCost[seg];
+}
+
+
+void ScheduleSimMetric::buildCostModel( LoopInfo* loop, std::vector<SimChunk>& chunks, CostModel& model )
+{
+	int64_t step = (loop->getStep() != 0) ? loop->getStep() : 1;
+	model._numIters = std::max( (int64_t)0, (loop->getUpper() - loop->getLower()) / step + 1 );
+	
+	// The time of every chunk is spread uniformly over its span. The spans of coalesced chunks
+	// overlap, so the segments are built by a sweep that sums the costs of the covering chunks.
+	std::vector< std::pair<int64_t, std::pair<int, double> > > events;	// Position, +1/-1, cost per iteration
+	for( std::vector<SimChunk>::iterator it = chunks.begin(); it != chunks.end(); ++it )
+	{
+		int64_t first = (it->_lower - loop->getLower()) / step;
+		int64_t last = (it->_upper - loop->getLower()) / step;
+		int64_t seg_begin = std::max( (int64_t)0, std::min( first, last ) );
+		int64_t seg_end = std::min( model._numIters, std::max( first, last ) + 1 );
+		if( seg_end <= seg_begin )
+			continue;
+		
+		double iter_cost = it->_time / (seg_end - seg_begin);
+		events.push_back( std::make_pair( seg_begin, std::make_pair( 1, iter_cost ) ) );
+		events.push_back( std::make_pair( seg_end, std::make_pair( -1, -iter_cost ) ) );
+	}
+	std::sort( events.begin(), events.end() );
+	
+	double prefix_cost = 0.0, iter_cost = 0.0;
+	int num_active = 0;
+	for( unsigned int i = 0; i < events.size(); ++i )
+	{
+		if( num_active > 0 && events[i].first > events[i - 1].first )
+		{
+			model._segBegin.push_back( events[i - 1].first );
+			model._segEnd.push_back( events[i].first );
+			model._segIterCost.push_back( iter_cost );
+			model._segPrefixCost.push_back( prefix_cost );
+			prefix_cost += iter_cost * (events[i].first - events[i - 1].first);
+		}
+		
+		num_active += events[i].second.first;
+		iter_cost += events[i].second.second;
+		if( num_active == 0 )
+			iter_cost = 0.0;
+	}
+}
+
+
+double ScheduleSimMetric::simulate( const CostModel& model, unsigned int num_threads, SimSchedule sched, int64_t chunk )
+{
+	int64_t num_iters = model._numIters;
+	double makespan = 0.0;
+	
+	if( sched == SIM_STATIC )
+	{
+		// The static assignment is computed once per thread
+		std::vector<double> thread_times( num_threads, _dispatchOverhead );
+		if( chunk <= 0 )
+		{
+			int64_t block = (num_iters + num_threads - 1) / num_threads;
+			for( unsigned int t = 0; t < num_threads && t * block < num_iters; ++t )
+				thread_times[t] += model.cost( t * block, std::min( num_iters, (t + 1) * block ) );
+		}
+		else
+		{
+			int64_t chunk_idx = 0;
+			for( int64_t first = 0; first < num_iters; first += chunk, ++chunk_idx )
+				thread_times[chunk_idx % num_threads] += model.cost( first, std::min( num_iters, first + chunk ) );
+		}
+		makespan = *std::max_element( thread_times.begin(), thread_times.end() );
+	}
+	else
+	{
+		// The next chunk is taken by the thread that becomes idle first
+		std::priority_queue< double, std::vector<double>, std::greater<double> > ready_times;
+		for( unsigned int t = 0; t < num_threads; ++t )
+			ready_times.push( 0.0 );
+		
+		int64_t first = 0;
+		while( first < num_iters )
+		{
+			int64_t size = chunk;
+			if( sched == SIM_GUIDED )
+				size = std::max( chunk, (num_iters - first + num_threads - 1) / num_threads );
+			int64_t last = std::min( num_iters, first + size );
+			
+			double finish_time = ready_times.top() + _dispatchOverhead + model.cost( first, last );
+			ready_times.pop();
+			ready_times.push( finish_time );
+			makespan = std::max( makespan, finish_time );
+			first = last;
+		}
+	}
+	
+	return makespan;
+}
+
+
+std::string ScheduleSimMetric::configToStr( const SimConfig& config )
+{
+	std::stringstream str_stream;
+	
+	str_stream << sim_sched_names[config._sched];
+	if( config._chunk > 0 && !(config._sched == SIM_GUIDED && config._chunk == 1) )
+		str_stream << "," << config._chunk;
+	
+	return str_stream.str();
+}
+
+
+void ScheduleSimMetric::init( Graph* tdg )
+{
+	Metric::init( tdg );
+	
+	std::vector<LoopInfo*>& loops = _tdg->getLoops();
+	std::vector< std::vector<SimChunk> > loop_chunks( loops.size() );
+	
+	NodeWalker walker( _tdg );
+	for( Node* curr_node = walker.next(); curr_node; curr_node = walker.next() )
+	{
+		if( curr_node->getType() == Node::CHUNK_TASK && curr_node->getLoopCounter() < loops.size() )
+		{
+			SimChunk chunk = { curr_node->getLower(), curr_node->getUpper(), curr_node->getThreadId(), curr_node->getTotalTime() };
+			loop_chunks[curr_node->getLoopCounter()].push_back( chunk );
+		}
+	}
+	
+	std::map<uint32_t, std::vector<unsigned int> > site_loops;
+	for( unsigned int i = 0; i < loops.size(); ++i )
+	{
+		if( !loop_chunks[i].empty() )
+			site_loops[loops[i]->getSiteId()].push_back( i );
+	}
+	
+	for( std::map<uint32_t, std::vector<unsigned int> >::iterator site_it = site_loops.begin(); 
+		 site_it != site_loops.end(); ++site_it )
+	{
+		std::vector<unsigned int>& instances = site_it->second;
+		
+		// Sites with many instances are represented by evenly spaced instances
+		std::vector<unsigned int> sim_instances;
+		unsigned int stride = (instances.size() + _maxInstances - 1) / _maxInstances;
+		for( unsigned int i = 0; i < instances.size(); i += stride )
+			sim_instances.push_back( instances[i] );
+		double scale = (double)instances.size() / sim_instances.size();
+		
+		std::vector<CostModel> models( sim_instances.size() );
+		int64_t max_iters = 0, min_chunk = 1;
+		unsigned int min_threads = 0;
+		for( unsigned int i = 0; i < sim_instances.size(); ++i )
+		{
+			LoopInfo* loop = loops[sim_instances[i]];
+			buildCostModel( loop, loop_chunks[sim_instances[i]], models[i] );
+			max_iters = std::max( max_iters, models[i]._numIters );
+			min_threads = (i == 0) ? loop->getTeamSize() : std::min( min_threads, loop->getTeamSize() );
+		}
+		min_threads = std::max( min_threads, 1u );
+		
+		_sites.push_back( SiteSim() );
+		SiteSim& site = _sites.back();
+		site._siteId = site_it->first;
+		site._numInstances = instances.size();
+		site._numSimulated = sim_instances.size();
+		
+		LoopInfo* first_loop = loops[sim_instances[0]];
+		site._recorded._sched = (first_loop->getSched() == ext_loop_sched_static) ? SIM_STATIC : 
+								((first_loop->getSched() == ext_loop_sched_guided) ? SIM_GUIDED : SIM_DYNAMIC);
+		site._recorded._chunk = first_loop->getChunkSize();
+		if( site._recorded._sched != SIM_STATIC )
+			site._recorded._chunk = std::max( site._recorded._chunk, (int64_t)1 );
+		
+		// Chunk sizes from 1 to the size of the static block
+		site._configs.push_back( SimConfig( SIM_STATIC, 0 ) );
+		for( int64_t chunk = 1; chunk <= (max_iters + min_threads - 1) / min_threads; chunk *= 2 )
+		{
+			if( max_iters / chunk > SIM_MAX_DISPATCHES )
+			{
+				min_chunk = chunk * 2;
+				continue;
+			}
+			site._configs.push_back( SimConfig( SIM_STATIC, chunk ) );
+			site._configs.push_back( SimConfig( SIM_DYNAMIC, chunk ) );
+			site._configs.push_back( SimConfig( SIM_GUIDED, chunk ) );
+		}
+		if( site._recorded._chunk >= min_chunk || site._recorded._chunk == 0 )
+			site._configs.push_back( site._recorded );
+		
+		for( unsigned int i = 0; i < sim_instances.size(); ++i )
+		{
+			LoopInfo* loop = loops[sim_instances[i]];
+			std::vector<double> busy_times( loop->getTeamSize(), 0.0 );
+			std::vector<SimChunk>& chunks = loop_chunks[sim_instances[i]];
+			for( std::vector<SimChunk>::iterator it = chunks.begin(); it != chunks.end(); ++it )
+			{
+				if( (unsigned int)it->_threadId >= busy_times.size() )
+					busy_times.resize( it->_threadId + 1, 0.0 );
+				busy_times[it->_threadId] += it->_time;
+			}
+			site._measuredTime += *std::max_element( busy_times.begin(), busy_times.end() ) * scale;
+			
+			for( std::vector<SimConfig>::iterator it = site._configs.begin(); it != site._configs.end(); ++it )
+				it->_time += simulate( models[i], std::max( loop->getTeamSize(), 1u ), it->_sched, it->_chunk ) * scale;
+		}
+		
+		if( site._recorded._chunk >= min_chunk || site._recorded._chunk == 0 )
+		{
+			site._recorded = site._configs.back();
+			site._configs.pop_back();
+		}
+		else
+		{
+			site._recorded._time = -1.0;	// Too many chunks to simulate
+		}
+		
+		site._best = site._configs[0];
+		for( std::vector<SimConfig>::iterator it = site._configs.begin(); it != site._configs.end(); ++it )
+		{
+			if( it->_time < site._best._time )
+				site._best = *it;
+		}
+	}
+}
+
+
+void ScheduleSimMetric::printMetric( std::ostream& out_stream )
+{
+	std::ofstream csv_file;
+	openFile( csv_file, _csvFilename );
+	
+	if( !csv_file.is_open() ) 
+	{
+		std::cerr << "libtdg: error opening csv file " << _csvFilename << std::endl;
+		exit( -2 );
+	}
 	
-	for( std::map<int64_t, Node*>::const_iterator it = graph_nodes.begin(); 
-		 it != graph_nodes.end(); ++it ) 
+	csv_file << "site,schedule,chunk,predicted_ms" << std::endl;
+	out_stream << "Schedule simulation dispatch overhead (ms): " << _dispatchOverhead << std::endl;
+	for( std::vector<SiteSim>::const_iterator it = _sites.begin(); it != _sites.end(); ++it )
 	{
-		Node* curr_node = it->second;
+		for( std::vector<SimConfig>::const_iterator c_it = it->_configs.begin(); c_it != it->_configs.end(); ++c_it )
+		{
+			csv_file << _tdg->getSiteName( it->_siteId ) << "," << sim_sched_names[c_it->_sched] << "," << c_it->_chunk << "," 
+			         << c_it->_time << std::endl;
+		}
 		
+		out_stream << "Loop site " << _tdg->getSiteName( it->_siteId ) << ": "
+		           << "instances " << it->_numInstances << " (simulated " << it->_numSimulated << ")"
+		           << ", recorded " << configToStr( it->_recorded ) 
+		           << " measured (ms) " << it->_measuredTime;
+		if( it->_recorded._time >= 0.0 )
+			out_stream << " predicted (ms) " << it->_recorded._time;
+		out_stream << ", recommended " << configToStr( it->_best ) 
+		           << " predicted (ms) " << it->_best._time << std::endl;
+	}
+	
+	csv_file.close();
+}
+
+//========================= ToolCostMetric ==============================
+
+void ToolCostMetric::init( Graph* tdg )
+{
+	Metric::init( tdg );
+	
+	std::vector<LoopInfo*>& loops = _tdg->getLoops();
+	std::vector<LoopToolCost> loop_costs( loops.size() );
+	
+	NodeWalker walker( _tdg );
+	for( Node* curr_node = walker.next(); curr_node; curr_node = walker.next() )
+	{
+		if( curr_node->getType() == Node::CHUNK_TASK && curr_node->getLoopCounter() < loops.size() )
+		{
+			LoopToolCost& loop_cost = loop_costs[curr_node->getLoopCounter()];
+			loop_cost._loop = loops[curr_node->getLoopCounter()];
+			loop_cost._numChunks += curr_node->getChunkCount();
+			loop_cost._chunksTime += curr_node->getTotalTime();
+			loop_cost._toolTime += curr_node->getToolTime();
+			_totalToolTime += curr_node->getToolTime();
+		}
+	}
+	
+	std::map<uint32_t, SiteToolCost> sites_map;
+	for( std::vector<LoopToolCost>::const_iterator it = loop_costs.begin(); it != loop_costs.end(); ++it )
+	{
+		if( !it->_loop )
+			continue;
+		_loops.push_back( *it );
+		
+		SiteToolCost& site = sites_map[it->_loop->getSiteId()];
+		site._siteId = it->_loop->getSiteId();
+		site._numInstances++;
+		site._numChunks += it->_numChunks;
+		site._chunksTime += it->_chunksTime;
+		site._toolTime += it->_toolTime;
+	}
+	
+	for( std::map<uint32_t, SiteToolCost>::const_iterator it = sites_map.begin(); it != sites_map.end(); ++it )
+		_sites.push_back( it->second );
+}
+
+
+void ToolCostMetric::printMetric( std::ostream& out_stream )
+{
+	std::ofstream csv_file;
+	openFile( csv_file, _csvFilename );
+	
+	if( !csv_file.is_open() ) 
+	{
+		std::cerr << "libtdg: error opening csv file " << _csvFilename << std::endl;
+		exit( -2 );
+	}
+	
+	csv_file << "site,loop,chunks,tool_ms,tool_per_chunk_ms,chunks_ms" << std::endl;
+	for( std::vector<LoopToolCost>::const_iterator it = _loops.begin(); it != _loops.end(); ++it )
+	{
+		csv_file << _tdg->getSiteName( it->_loop->getSiteId() ) << "," << it->_loop->getId() << "," 
+		         << it->_numChunks << "," << it->_toolTime << "," << (it->_toolTime / it->_numChunks) << "," 
+		         << it->_chunksTime << std::endl;
+	}
+	
+	// The runtime dispatches the next chunk before the callback, so this is the time of the tool, 
+	// not the dispatch overhead of the runtime
+	out_stream << "Tool time in the chunk callbacks, not runtime dispatch time (ms): " << _totalToolTime << std::endl;
+	for( std::vector<SiteToolCost>::const_iterator it = _sites.begin(); it != _sites.end(); ++it )
+	{
+		double ratio = (it->_chunksTime > 0.0) ? (it->_toolTime / it->_chunksTime) : 0.0;
+		
+		out_stream << "Loop site " << _tdg->getSiteName( it->_siteId ) << ": "
+		           << "instances " << it->_numInstances
+		           << ", chunks " << it->_numChunks
+		           << ", tool time (ms) " << it->_toolTime
+		           << ", tool time per chunk (ms) " << (it->_toolTime / it->_numChunks)
+		           << ", mean chunk time (ms) " << (it->_chunksTime / it->_numChunks)
+		           << ", tool/chunk time " << ratio
+		           << ((ratio > _threshold) ? " - capture perturbs the chunks" : "") << std::endl;
+	}
+	
+	csv_file.close();
+}
+
+//========================== SiteMetric ================================
+
+bool SiteMetric::compareImpact( const SiteSummary& a, const SiteSummary& b )
+{
+	if( a._criticalTime != b._criticalTime )
+		return a._criticalTime > b._criticalTime;
+	return a._stats.getWork() > b._stats.getWork();
+}
+
+
+void SiteMetric::init( Graph* tdg )
+{
+	Metric::init( tdg );
+	
+	// Merge the per-thread tables
+	std::map<uint32_t, SiteSummary> sites_map;
+	std::vector<SiteStatsTable*>& tables = _tdg->getSiteStats();
+	for( std::vector<SiteStatsTable*>::const_iterator t_it = tables.begin(); t_it != tables.end(); ++t_it )
+	{
+		for( SiteStatsTable::const_iterator it = (*t_it)->begin(); it != (*t_it)->end(); ++it )
+		{
+			SiteSummary& site = sites_map[it->first];
+			site._siteId = it->first;
+			site._stats.merge( it->second );
+		}
+	}
+	
+	// The contribution to the critical path needs the nodes
+	if( !_tdg->getGraphNodes().empty() )
+	{
+		CriticalPathMetric critical_path;
+		critical_path.init( _tdg );
+		_criticalTime = critical_path.getMetric();
+		
+		const std::map< uint32_t, std::pair<double, int> >& site_times = critical_path.getSiteTimes();
+		for( std::map< uint32_t, std::pair<double, int> >::const_iterator it = site_times.begin(); it != site_times.end(); ++it )
+		{
+			std::map<uint32_t, SiteSummary>::iterator site_it = sites_map.find( it->first );
+			if( site_it != sites_map.end() )
+				site_it->second._criticalTime += it->second.first;
+		}
+	}
+	
+	for( std::map<uint32_t, SiteSummary>::const_iterator it = sites_map.begin(); it != sites_map.end(); ++it )
+		_sites.push_back( it->second );
+	std::sort( _sites.begin(), _sites.end(), compareImpact );
+}
+
+
+void SiteMetric::printMetric( std::ostream& out_stream )
+{
+	out_stream << "Call sites: " << _sites.size() << std::endl;
+	out_stream << "Critical path (ms): " << _criticalTime << std::endl;
+	for( std::vector<SiteSummary>::const_iterator it = _sites.begin(); it != _sites.end(); ++it )
+	{
+		const SiteStats& stats = it->_stats;
+		
+		out_stream << "Site " << _tdg->getSiteName( it->_siteId ) << " (" << stats.getKindStr() << "): "
+		           << "instances " << stats.getNumInstances()
+		           << ", work (ms) " << stats.getWork()
+		           << ", critical path (ms) " << it->_criticalTime
+		           << " (" << ((_criticalTime > 0.0) ? (100.0 * it->_criticalTime / _criticalTime) : 0.0) << "%)"
+		           << ", mean (ms) " << (stats.getTotalTime() / stats.getNumInstances())
+		           << ", p99 (ms) " << stats.getPercentile( 0.99 )
+		           << ", efficiency ";
+		if( stats.getCapacity() > 0.0 )
+			out_stream << (stats.getWork() / stats.getCapacity()) << std::endl;
+		else
+			out_stream << "-" << std::endl;
+	}
+}
+
+//========================== SlackMetric ===============================
+
+bool SlackMetric::compareSlack( Node* a, Node* b )
+{
+	if( a->getSlack() != b->getSlack() )
+		return a->getSlack() < b->getSlack();
+	return a->getTotalTime() > b->getTotalTime();
+}
+
+
+// Forward pass for the earliest finish times and backward pass for the latest finish times over
+// the same topological order. The slack of a node is how much it can be delayed without making
+// the critical path longer.
+void SlackMetric::init( Graph* tdg )
+{
+	Metric::init( tdg );
+	
+	std::list<Node*> topo_list;
+	_tdg->topoSort( topo_list );
+	
+	std::unordered_map<Node*, double> finish_times;
+	finish_times.reserve( topo_list.size() );
+	for( std::list<Node*>::iterator l_iter = topo_list.begin(); l_iter != topo_list.end(); ++l_iter ) 
+	{
+		Node* curr_node = *l_iter;
+		double start_time = 0.0;
+		Node::AdjacencyIterator adj_iter = Node::AdjacencyIterator::beginAdjIter( curr_node, true );	// Entry edges
+		Node::AdjacencyIterator adj_iter_end = Node::AdjacencyIterator::endAdjIter( curr_node, true );
+		for( ; adj_iter != adj_iter_end; ++adj_iter )
+			start_time = std::max( start_time, finish_times[*adj_iter] );
+		finish_times[curr_node] = start_time + curr_node->getSpanTime();
+		_criticalTime = std::max( _criticalTime, finish_times[curr_node] );
+	}
+	
+	std::unordered_map<Node*, double> latest_finish_times;
+	latest_finish_times.reserve( topo_list.size() );
+	double threshold = _criticalTime * _slackPct / 100.0;
+	for( std::list<Node*>::reverse_iterator l_iter = topo_list.rbegin(); l_iter != topo_list.rend(); ++l_iter ) 
+	{
+		Node* curr_node = *l_iter;
+		double latest_finish = _criticalTime;
+		Node::AdjacencyIterator adj_iter = Node::AdjacencyIterator::beginAdjIter( curr_node, false );	// Exit edges
+		Node::AdjacencyIterator adj_iter_end = Node::AdjacencyIterator::endAdjIter( curr_node, false );
+		for( ; adj_iter != adj_iter_end; ++adj_iter )
+			latest_finish = std::min( latest_finish, latest_finish_times[*adj_iter] - (*adj_iter)->getSpanTime() );
+		latest_finish_times[curr_node] = latest_finish;
+		
+		double slack = std::max( 0.0, latest_finish - finish_times[curr_node] );
+		curr_node->setSlack( slack );
+		if( slack <= threshold && curr_node->getSpanTime() > 0.0 )
+			_nearCritical.push_back( curr_node );
+	}
+	
+	std::sort( _nearCritical.begin(), _nearCritical.end(), compareSlack );
+}
+
+
+void SlackMetric::printMetric( std::ostream& out_stream )
+{
+	std::ofstream log_file;
+	openFile( log_file, _logFilename );
+	
+	if( !log_file.is_open() ) 
+	{
+		std::cerr << "libtdg: error opening log file " << _logFilename << std::endl;
+		exit( -2 );
+	}
+	
+	// Near critical time per call site, without the critical nodes themselves
+	std::map<uint32_t, double> site_times;
+	unsigned int num_critical = 0;
+	for( std::vector<Node*>::const_iterator it = _nearCritical.begin(); it != _nearCritical.end(); ++it )
+	{
+		Node* curr_node = *it;
+		log_file << "node " << curr_node->getId()
+		         << "  type " << curr_node->getTypeStr()
+		         << "  site " << _tdg->getSiteName( curr_node->getSiteId() )
+		         << "  time " << curr_node->getTotalTime()
+		         << "  slack " << curr_node->getSlack() << std::endl;
+		
+		if( curr_node->getSlack() < EPSILON )
+			num_critical++;
+		else
+			site_times[curr_node->getSiteId()] += curr_node->getSpanTime();
+	}
+	
+	log_file.close();
+	
+	out_stream << "Critical path (ms): " << _criticalTime << std::endl;
+	out_stream << "Nodes within " << _slackPct << "% slack of the critical path: " << _nearCritical.size()
+	           << " (" << num_critical << " critical)" << std::endl;
+	
+	std::vector< std::pair<double, uint32_t> > sites;
+	for( std::map<uint32_t, double>::const_iterator it = site_times.begin(); it != site_times.end(); ++it )
+		sites.push_back( std::make_pair( it->second, it->first ) );
+	std::sort( sites.begin(), sites.end(), std::greater< std::pair<double, uint32_t> >() );
+	for( unsigned int i = 0; i < sites.size(); ++i )
+		out_stream << "Near critical site " << _tdg->getSiteName( sites[i].second ) << ": time (ms) " << sites[i].first << std::endl;
+}
+
+//========================== KPathsMetric ==============================
+
+// Every node keeps the K longest paths that end in it, sorted by time. They are merged from the
+// lists of the predecessors with a heap, so the pass costs O(E + V*K*log(deg)).
+void KPathsMetric::init( Graph* tdg )
+{
+	Metric::init( tdg );
+	
+	std::list<Node*> topo_list;
+	_tdg->topoSort( topo_list );
+	std::vector<Node*> nodes( topo_list.begin(), topo_list.end() );
+	std::unordered_map<Node*, int64_t> node_idx;
+	node_idx.reserve( nodes.size() );
+	for( size_t i = 0; i < nodes.size(); ++i )
+		node_idx[nodes[i]] = i;
+	
+	// Heap items: (time, (predecessor, entry))
+	typedef std::pair< double, std::pair<int64_t, unsigned int> > HeapItem;
+	std::vector< std::vector<PathEntry> > entries( nodes.size() );
+	std::vector<HeapItem> sinks_heap;
+	
+	for( size_t i = 0; i < nodes.size(); ++i )
+	{
+		Node* curr_node = nodes[i];
+		std::priority_queue<HeapItem> heap;
+		Node::AdjacencyIterator adj_iter = Node::AdjacencyIterator::beginAdjIter( curr_node, true );	// Entry edges
+		Node::AdjacencyIterator adj_iter_end = Node::AdjacencyIterator::endAdjIter( curr_node, true );
+		for( ; adj_iter != adj_iter_end; ++adj_iter )
+		{
+			int64_t pred = node_idx[*adj_iter];
+			heap.push( std::make_pair( entries[pred][0]._time, std::make_pair( pred, 0u ) ) );
+		}
+		
+		std::vector<PathEntry>& curr_entries = entries[i];
+		if( heap.empty() )
+		{
+			PathEntry entry = { curr_node->getSpanTime(), -1, 0 };
+			curr_entries.push_back( entry );
+		}
+		while( !heap.empty() && curr_entries.size() < _numPaths )
+		{
+			HeapItem item = heap.top();
+			heap.pop();
+			int64_t pred = item.second.first;
+			unsigned int pred_entry = item.second.second;
+			PathEntry entry = { item.first + curr_node->getSpanTime(), pred, pred_entry };
+			curr_entries.push_back( entry );
+			if( pred_entry + 1 < entries[pred].size() )
+				heap.push( std::make_pair( entries[pred][pred_entry + 1]._time, std::make_pair( pred, pred_entry + 1 ) ) );
+		}
+		
+		if( curr_node->getExits().empty() )
+		{
+			for( unsigned int e = 0; e < curr_entries.size(); ++e )
+				sinks_heap.push_back( std::make_pair( curr_entries[e]._time, std::make_pair( (int64_t)i, e ) ) );
+		}
+	}
+	
+	// The longest paths among the paths that end in the sinks
+	unsigned int num_paths = std::min( (size_t)_numPaths, sinks_heap.size() );
+	std::partial_sort( sinks_heap.begin(), sinks_heap.begin() + num_paths, sinks_heap.end(), std::greater<HeapItem>() );
+	for( unsigned int p = 0; p < num_paths; ++p )
+	{
+		_paths.push_back( Path() );
+		Path& path = _paths.back();
+		path._time = sinks_heap[p].first;
+		
+		int64_t node = sinks_heap[p].second.first;
+		unsigned int entry = sinks_heap[p].second.second;
+		while( node >= 0 )
+		{
+			path._nodes.push_back( nodes[node] );
+			const PathEntry& path_entry = entries[node][entry];
+			node = path_entry._pred;
+			entry = path_entry._predEntry;
+		}
+		std::reverse( path._nodes.begin(), path._nodes.end() );
+	}
+}
+
+
+void KPathsMetric::printMetric( std::ostream& out_stream )
+{
+	std::ofstream log_file;
+	openFile( log_file, _logFilename );
+	
+	if( !log_file.is_open() ) 
+	{
+		std::cerr << "libtdg: error opening log file " << _logFilename << std::endl;
+		exit( -2 );
+	}
+	
+	out_stream << "Longest paths: " << _paths.size() << std::endl;
+	for( unsigned int p = 0; p < _paths.size(); ++p )
+	{
+		const Path& path = _paths[p];
+		
+		// Call site composition of the path
+		std::map<uint32_t, double> site_times;
+		log_file << "path " << p << "  time " << path._time << "  nodes " << path._nodes.size() << std::endl;
+		for( std::vector<Node*>::const_iterator it = path._nodes.begin(); it != path._nodes.end(); ++it )
+		{
+			log_file << "  node " << (*it)->getId() << "  type " << (*it)->getTypeStr()
+			         << "  site " << _tdg->getSiteName( (*it)->getSiteId() )
+			         << "  time " << (*it)->getSpanTime() << std::endl;
+			if( (*it)->getSpanTime() > 0.0 )
+				site_times[(*it)->getSiteId()] += (*it)->getSpanTime();
+		}
+		
+		std::vector< std::pair<double, uint32_t> > sites;
+		for( std::map<uint32_t, double>::const_iterator it = site_times.begin(); it != site_times.end(); ++it )
+			sites.push_back( std::make_pair( it->second, it->first ) );
+		std::sort( sites.begin(), sites.end(), std::greater< std::pair<double, uint32_t> >() );
+		
+		out_stream << "Path " << p << ": time (ms) " << path._time << ", nodes " << path._nodes.size() << ", sites";
+		for( unsigned int i = 0; i < sites.size(); ++i )
+		{
+			out_stream << (i ? ", " : " ") << _tdg->getSiteName( sites[i].second ) << " "
+			           << ((path._time > 0.0) ? (100.0 * sites[i].first / path._time) : 0.0) << "%";
+		}
+		out_stream << std::endl;
+	}
+	
+	log_file.close();
+}
+
+//========================= WhatIfAnalysis =============================
+
+WhatIfAnalysis::WhatIfAnalysis( Graph* tdg ) : _span( 0.0 )
+{
+	std::list<Node*> topo_list;
+	tdg->topoSort( topo_list );
+	_nodes.assign( topo_list.begin(), topo_list.end() );
+	_nodeIdx.reserve( _nodes.size() );
+	_finishTimes.resize( _nodes.size(), 0.0 );
+	
+	std::unordered_map<size_t, double> no_changes;
+	for( size_t i = 0; i < _nodes.size(); ++i )
+	{
+		Node* curr_node = _nodes[i];
+		_nodeIdx[curr_node] = i;
+		_finishTimes[i] = finishTime( i, no_changes ) + curr_node->getSpanTime();
+		_span = std::max( _span, _finishTimes[i] );
+		
+		if( curr_node->getExits().empty() )
+			_sinks.push_back( i );
+		if( curr_node->getSpanTime() > 0.0 && !tdg->isInstanceNode( curr_node ) )
+			_siteNodes[curr_node->getSiteId()].push_back( curr_node );
+	}
+	
+	std::vector< std::pair<double, size_t> > sinks;
+	for( size_t i = 0; i < _sinks.size(); ++i )
+		sinks.push_back( std::make_pair( _finishTimes[_sinks[i]], _sinks[i] ) );
+	std::sort( sinks.begin(), sinks.end(), std::greater< std::pair<double, size_t> >() );
+	for( size_t i = 0; i < sinks.size(); ++i )
+		_sinks[i] = sinks[i].second;
+}
+
+
+// Latest finish time of the predecessors of the node (its start time)
+double WhatIfAnalysis::finishTime( size_t idx, const std::unordered_map<size_t, double>& new_finish ) const
+{
+	double start_time = 0.0;
+	Node::AdjacencyIterator adj_iter = Node::AdjacencyIterator::beginAdjIter( _nodes[idx], true );	// Entry edges
+	Node::AdjacencyIterator adj_iter_end = Node::AdjacencyIterator::endAdjIter( _nodes[idx], true );
+	for( ; adj_iter != adj_iter_end; ++adj_iter )
+	{
+		std::unordered_map<Node*, size_t>::const_iterator pred_it = _nodeIdx.find( *adj_iter );
+		if( pred_it == _nodeIdx.end() )
+			continue;
+		std::unordered_map<size_t, double>::const_iterator it = new_finish.find( pred_it->second );
+		start_time = std::max( start_time, (it != new_finish.end()) ? it->second : _finishTimes[pred_it->second] );
+	}
+	return start_time;
+}
+
+
+double WhatIfAnalysis::predictSpan( const std::vector<Node*>& nodes, double speedup,
+									const std::vector< std::pair<Node*, double> >& new_times )
+{
+	std::unordered_map<size_t, double> node_times;
+	std::unordered_map<size_t, double> new_finish;
+	std::priority_queue< size_t, std::vector<size_t>, std::greater<size_t> > worklist;	// Topological order
+	
+	for( std::vector<Node*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it )
+	{
+		size_t idx = _nodeIdx[*it];
+		if( node_times.insert( std::make_pair( idx, (*it)->getSpanTime() / speedup ) ).second )
+			worklist.push( idx );
+	}
+	for( std::vector< std::pair<Node*, double> >::const_iterator it = new_times.begin(); it != new_times.end(); ++it )
+	{
+		size_t idx = _nodeIdx[it->first];
+		if( node_times.insert( std::make_pair( idx, it->second ) ).second )
+			worklist.push( idx );
+	}
+	
+	// A node is visited after all its predecessors, so its new finish time is final. The cone 
+	// stops at the nodes whose finish time does not change.
+	while( !worklist.empty() )
+	{
+		size_t idx = worklist.top();
+		worklist.pop();
+		while( !worklist.empty() && worklist.top() == idx )
+			worklist.pop();
+		
+		std::unordered_map<size_t, double>::const_iterator time_it = node_times.find( idx );
+		double time = (time_it != node_times.end()) ? time_it->second : _nodes[idx]->getSpanTime();
+		double finish_time = finishTime( idx, new_finish ) + time;
+		if( finish_time == _finishTimes[idx] )
+			continue;
+		
+		new_finish[idx] = finish_time;
+		Node::AdjacencyIterator adj_iter = Node::AdjacencyIterator::beginAdjIter( _nodes[idx], false );	// Exit edges
+		Node::AdjacencyIterator adj_iter_end = Node::AdjacencyIterator::endAdjIter( _nodes[idx], false );
+		for( ; adj_iter != adj_iter_end; ++adj_iter )
+			worklist.push( _nodeIdx[*adj_iter] );
+	}
+	
+	// The changed sinks and the longest unchanged sink
+	double span = 0.0;
+	for( std::unordered_map<size_t, double>::const_iterator it = new_finish.begin(); it != new_finish.end(); ++it )
+	{
+		if( _nodes[it->first]->getExits().empty() )
+			span = std::max( span, it->second );
+	}
+	for( size_t i = 0; i < _sinks.size(); ++i )
+	{
+		if( new_finish.find( _sinks[i] ) == new_finish.end() )
+		{
+			span = std::max( span, _finishTimes[_sinks[i]] );
+			break;
+		}
+	}
+	return span;
+}
+
+
+double WhatIfAnalysis::predictSiteSpan( uint32_t site_id, double speedup )
+{
+	return predictSpan( _siteNodes[site_id], speedup );
+}
+
+
+double WhatIfAnalysis::recomputeSpan( const std::vector<Node*>& nodes, double speedup,
+									  const std::vector< std::pair<Node*, double> >& new_times ) const
+{
+	std::unordered_map<size_t, double> new_finish;
+	std::vector<double> node_times( _nodes.size() );
+	for( size_t i = 0; i < _nodes.size(); ++i )
+		node_times[i] = _nodes[i]->getSpanTime();
+	for( std::vector<Node*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it )
+		node_times[_nodeIdx.find( *it )->second] = (*it)->getSpanTime() / speedup;
+	for( std::vector< std::pair<Node*, double> >::const_iterator it = new_times.begin(); it != new_times.end(); ++it )
+		node_times[_nodeIdx.find( it->first )->second] = it->second;
+	
+	double span = 0.0;
+	for( size_t i = 0; i < _nodes.size(); ++i )
+	{
+		new_finish[i] = finishTime( i, new_finish ) + node_times[i];
+		span = std::max( span, new_finish[i] );
+	}
+	return span;
+}
+
+
+std::vector<uint32_t> WhatIfAnalysis::getSites() const
+{
+	std::vector<uint32_t> sites;
+	for( std::unordered_map< uint32_t, std::vector<Node*> >::const_iterator it = _siteNodes.begin(); it != _siteNodes.end(); ++it )
+		sites.push_back( it->first );
+	std::sort( sites.begin(), sites.end() );
+	return sites;
+}
+
+//========================== WhatIfMetric ==============================
+
+// A folded instance (TDG_TEMPLATES) is analyzed on its own, and a faster site sets the time of the
+// node that stands for the instance to the new span of the instance
+void WhatIfMetric::init( Graph* tdg )
+{
+	Metric::init( tdg );
+	
+	WhatIfAnalysis what_if( _tdg );
+	_span = what_if.getSpan();
+	
+	std::map<uint32_t, double> site_work;
+	std::map< uint32_t, std::vector< std::pair<Node*, double> > > instance_times;
+	std::vector<uint32_t> sites = what_if.getSites();
+	for( std::vector<uint32_t>::const_iterator it = sites.begin(); it != sites.end(); ++it )
+	{
+		const std::vector<Node*>& site_nodes = what_if.getSiteNodes( *it );
+		double& work = site_work[*it];
+		for( std::vector<Node*>::const_iterator n_it = site_nodes.begin(); n_it != site_nodes.end(); ++n_it )
+			work += (*n_it)->getTotalTime();
+	}
+	
+	for( size_t k = 0; k < _tdg->getNumInstances(); ++k )
+	{
+		Graph instance;
+		Node* instance_node = _tdg->expandInstance( k, instance );
+		WhatIfAnalysis instance_what_if( &instance );
+		sites = instance_what_if.getSites();
+		for( std::vector<uint32_t>::const_iterator it = sites.begin(); it != sites.end(); ++it )
+		{
+			const std::vector<Node*>& site_nodes = instance_what_if.getSiteNodes( *it );
+			double& work = site_work[*it];
+			for( std::vector<Node*>::const_iterator n_it = site_nodes.begin(); n_it != site_nodes.end(); ++n_it )
+				work += (*n_it)->getTotalTime();
+			instance_times[*it].push_back( std::make_pair( instance_node, instance_what_if.predictSiteSpan( *it, _speedup ) ) );
+		}
+	}
+	
+	for( std::map<uint32_t, double>::const_iterator it = site_work.begin(); it != site_work.end(); ++it )
+	{
+		SiteWhatIf site;
+		site._siteId = it->first;
+		site._work = it->second;
+		const std::vector<Node*>& site_nodes = what_if.getSiteNodes( it->first );
+		const std::vector< std::pair<Node*, double> >& new_times = instance_times[it->first];
+		site._newSpan = what_if.predictSpan( site_nodes, _speedup, new_times );
+		if( _check )
+			_maxError = std::max( _maxError, std::abs( site._newSpan - what_if.recomputeSpan( site_nodes, _speedup, new_times ) ) );
+		_sites.push_back( site );
+	}
+	std::stable_sort( _sites.begin(), _sites.end(), compareSpan );
+}
+
+
+void WhatIfMetric::printMetric( std::ostream& out_stream )
+{
+	out_stream << "What-if span (ms): " << _span << ", site speedup " << _speedup << std::endl;
+	if( _check )
+		out_stream << "What-if check: max difference from a full recomputation (ms) " << _maxError << std::endl;
+	for( std::vector<SiteWhatIf>::const_iterator it = _sites.begin(); it != _sites.end(); ++it )
+	{
+		out_stream << "Site " << _tdg->getSiteName( it->_siteId ) << ": work (ms) " << it->_work
+		           << ", predicted span (ms) " << it->_newSpan
+		           << ", program speedup " << ((it->_newSpan > 0.0) ? (_span / it->_newSpan) : 1.0) << std::endl;
+	}
+}
+
+//======================== SampleMetric ==============================
+
+// Total of a population of num_instances from a simple random sample of num_sampled, and the half
+// width of its 95% confidence interval with the finite population correction
+void SampleMetric::estimate( uint64_t num_instances, uint64_t num_sampled, double sum, double sq_sum, 
+							 double& total, double& err )
+{
+	total = 0.0;
+	err = 0.0;
+	if( num_sampled == 0 )
+		return;
+	
+	double mean = sum / num_sampled;
+	total = mean * num_instances;
+	if( num_sampled > 1 )
+	{
+		double variance = std::max( 0.0, (sq_sum - num_sampled * mean * mean) / (num_sampled - 1) );
+		double fpc = (double)(num_instances - std::min( num_instances, num_sampled )) / num_instances;
+		err = 1.96 * num_instances * std::sqrt( variance / num_sampled * fpc );
+	}
+}
+
+
+// Top-level regions do not overlap, so their totals are added up; the errors of the sites are
+// independent and are added in quadrature
+void SampleMetric::init( Graph* tdg )
+{
+	Metric::init( tdg );
+	
+	std::map<uint32_t, SampleSite>& samples = tdg->getSampleSites();
+	for( std::map<uint32_t, SampleSite>::const_iterator it = samples.begin(); it != samples.end(); ++it )
+	{
+		const SampleSite& sample = it->second;
+		SiteEstimate site;
+		site._siteId = it->first;
+		site._numInstances = sample._numInstances;
+		site._numSampled = sample._numSampled;
+		site._countedWork = sample._countedWork;
+		estimate( sample._numInstances, sample._numSampled, sample._workSum, sample._workSqSum, site._work, site._workErr );
+		estimate( sample._numInstances, sample._numSampled, sample._spanSum, sample._spanSqSum, site._span, site._spanErr );
+		_sites.push_back( site );
+		
+		_work += site._work;
+		_workErr += site._workErr * site._workErr;
+		_span += site._span;
+		_spanErr += site._spanErr * site._spanErr;
+		_countedWork += site._countedWork;
+	}
+	_workErr = std::sqrt( _workErr );
+	_spanErr = std::sqrt( _spanErr );
+}
+
+
+void SampleMetric::printMetric( std::ostream& out_stream )
+{
+	out_stream << "Sampled regions: work (ms) " << _work << " +- " << _workErr
+	           << ", critical path (ms) " << _span << " +- " << _spanErr
+	           << ", counted work (ms) " << _countedWork << std::endl;
+	for( std::vector<SiteEstimate>::const_iterator it = _sites.begin(); it != _sites.end(); ++it )
+	{
+		out_stream << "Site " << _tdg->getSiteName( it->_siteId ) << ": sampled " << it->_numSampled 
+		           << " of " << it->_numInstances;
+		if( it->_numSampled )
+		{
+			out_stream << ", work (ms) " << it->_work << " +- " << it->_workErr
+			           << ", critical path (ms) " << it->_span << " +- " << it->_spanErr;
+		}
+		out_stream << ", counted work (ms) " << it->_countedWork << std::endl;
+	}
+}
+
+//======================= SelfMetric ==============================
+
+double SelfMetric::cyclesToMsec( uint64_t cycles )
+{
+	return ftimer_freq() ? 1e3 * (double)cycles / (double)ftimer_freq() : 0.0;
+}
+
+
+void SelfMetric::init( Graph* tdg )
+{
+	Metric::init( tdg );
+	
+	std::vector<CallbackProfile*>& profiles = _tdg->getCallbackProfiles();
+	for( std::vector<CallbackProfile*>::const_iterator p_it = profiles.begin(); p_it != profiles.end(); ++p_it )
+	{
+		uint64_t calls = 0, cycles = 0;
+		for( unsigned int i = 0; i < NUM_TOOL_CALLBACKS; ++i )
+		{
+			const CallbackStats& stats = (**p_it)[i];
+			_callbacks[i].merge( stats );
+			calls += stats.getCount();
+			cycles += stats.getTotal();
+		}
+		_threadCalls.push_back( calls );
+		_threadCycles.push_back( cycles );
+		_totalCycles += cycles;
+	}
+	
+	NodeWalker walker( _tdg );
+	for( Node* curr_node = walker.next(); curr_node; curr_node = walker.next() )
+		_work += curr_node->getTotalTime();
+}
+
+
+void SelfMetric::printMetric( std::ostream& out_stream )
+{
+	double tool_time = cyclesToMsec( _totalCycles );
+	out_stream << "Tool callbacks: " << _totalCycles << " cycles, time (ms) " << tool_time;
+	if( _work > 0.0 )
+		out_stream << " (" << tool_time / _work * 100.0 << "% of the work in the graph)";
+	out_stream << std::endl;
+	
+	// The callbacks that cost the most first
+	std::vector< std::pair<uint64_t, unsigned int> > order;
+	for( unsigned int i = 0; i < NUM_TOOL_CALLBACKS; ++i )
+		if( _callbacks[i].getCount() )
+			order.push_back( std::make_pair( _callbacks[i].getTotal(), i ) );
+	std::sort( order.begin(), order.end(), std::greater< std::pair<uint64_t, unsigned int> >() );
+	
+	for( unsigned int k = 0; k < order.size(); ++k )
+	{
+		const CallbackStats& stats = _callbacks[order[k].second];
+		out_stream << "Callback " << CallbackStats::getName( (ToolCallback)order[k].second ) 
+		           << ": count " << stats.getCount() << ", total " << stats.getTotal() << " cycles (" 
+		           << (_totalCycles ? 100.0 * stats.getTotal() / _totalCycles : 0.0) << "%), min " << stats.getMin()
+		           << ", p50 " << stats.getPercentile( 0.5 ) << ", p99 " << stats.getPercentile( 0.99 )
+		           << ", max " << stats.getMax() << std::endl;
+	}
+	
+	for( unsigned int i = 0; i < _threadCycles.size(); ++i )
+	{
+		out_stream << "Thread " << i << ": " << _threadCalls[i] << " callbacks, " << _threadCycles[i] 
+		           << " cycles, time (ms) " << cyclesToMsec( _threadCycles[i] ) << std::endl;
+	}
+}
+
+//======================= LogFileMetric ==============================
+
+void LogFileMetric::printMetric( std::ostream& out_stream )
+{
+	std::ofstream log_file;
+	openFile( log_file, _logFilename );
+	
+	if( !log_file.is_open() ) 
+	{
+		std::cerr << "libtdg: error opening log file " << _logFilename << std::endl;
+		exit( -2 );
+	}
+	
+	NodeWalker walker( _tdg );
+	for( Node* curr_node = walker.next(); curr_node; curr_node = walker.next() )
+	{
 		if( curr_node->getType() == Node::CHUNK_TASK )
 		{
+			// The loop id of the run, also in the graph of a finalized region
+			LoopInfo* loop = _tdg->getLoop( curr_node->getLoopCounter() );
 			log_file << curr_node->getId() << "  " 
 			         << curr_node->getTotalTime() << "  "
 			         << curr_node->getThreadId() << "  " 
-			         << curr_node->getLoopCounter() << "  [" 
+			         << (loop ? loop->getId() : curr_node->getLoopCounter()) << "  [" 
 			         << curr_node->getLower() << "," 
-			         << curr_node->getUpper() << "] " 
-			         << curr_node->papiValsToStr( " " ) << std::endl; 
+			         << curr_node->getUpper() << "] ";
+			if( curr_node->getChunkCount() > 1 )
+				log_file << "x" << curr_node->getChunkCount() << " ";
+			log_file << curr_node->papiValsToStr( " " ) << std::endl; 
 		}
 	}
 
@@ -21,37 +21,81 @@
 #ifndef __METRICS_H__
 #define __METRICS_H__
 
+#include <unordered_map>
+#include <fstream>
 #include "graph.h"
 
 
 namespace libtdg
 {
+	// Walks the nodes that have a time of their own: the nodes of the graph, and the nodes of the
+	// folded region instances (TDG_TEMPLATES) in place of the nodes that stand for them. The instances
+	// are expanded one at a time, so a node of an instance is only valid until the next call.
+	class NodeWalker {
+	public:
+		NodeWalker( Graph* tdg ) : _tdg( tdg ), _it( tdg->getGraphNodes().begin() ), _nextInstance( 0 ), _instance( NULL ) {}
+		~NodeWalker() { delete _instance; }
+		
+		// Returns NULL after the last node
+		Node* next();
+		
+	private:
+		Graph*					_tdg;
+		Graph::NodesIterator	_it;
+		size_t					_nextInstance;
+		Graph*					_instance;		// Holds the nodes of the current instance
+	};
+	
 	class Metric {
 	public:	
-		Metric () : _tdg( NULL ) {}
+		Metric () : _tdg( NULL ), _appendFile( false ) {}
 		virtual ~Metric () {}
 	
 		virtual void init( Graph* tdg ) { _tdg = tdg; }
 		virtual double getMetric () = 0;
 		virtual void printMetric( std::ostream& out_stream ) = 0;
+		
+		// A metric that writes a file starts it with a line that names the section, if it is set, and
+		// adds to the end of the file instead of replacing it if append is set. One file can then
+		// collect the output of the metric for several graphs.
+		void setFileSection( const std::string& section, bool append ) { _fileSection = section; _appendFile = append; }
 	
 	protected:
-		Graph*	_tdg;
+		void openFile( std::ofstream& file, const std::string& file_name );
+		
+		Graph*		_tdg;
+		std::string	_fileSection;
+		bool		_appendFile;
 	};
 
 	class CriticalPathMetric : public Metric {
 	public:
-		CriticalPathMetric () : _critical_path_time_len( -1 ) {}
+		CriticalPathMetric () 
+		: _critical_path_time_len( -1 ), _typeTimes( Node::NUM_NODE_TYPES, 0.0 ), _typeCounts( Node::NUM_NODE_TYPES, 0 ) {}
 		virtual ~CriticalPathMetric () {}
 	
 		virtual double getMetric( );
 		virtual void printMetric( std::ostream& out_stream );
+		
+		const std::map< uint32_t, std::pair<double, int> >& getSiteTimes( ) { getMetric( ); return _siteTimes; }
 	
 	private:
 		double _critical_path_time_len;
 		int _critical_path_len;
+		
+		// Breakdown of the critical path by node type and by call site
+		std::vector<double>	_typeTimes;
+		std::vector<int>	_typeCounts;
+		std::map< uint32_t, std::pair<double, int> > _siteTimes;
 	
 		void computeCriticalPath( );
+		
+		// Longest paths to every node in topological order, returns the last node of the longest one
+		Node* scanPaths( std::list<Node*>& topo_list, double& path_time, int& path_len );
+		
+		// Adds the nodes of the path that ends in the node to the breakdown. The path continues inside
+		// the folded instances on it.
+		double addPath( Node* last_node );
 	};
 
 	class TotalTimeMetric : public Metric {
@@ -89,6 +133,391 @@ namespace libtdg
 		std::string     _dotFilename;
 	};
 	
+	class ImbalanceMetric : public Metric
+	{
+	public:
+		ImbalanceMetric( const char* logfile ) : _logFilename( logfile ), _totalWastedTime( 0.0 ) {}
+		
+		virtual void init( Graph* tdg );
+		virtual double getMetric( ) { return _totalWastedTime; }
+		virtual void printMetric( std::ostream& out_stream );
+		
+	private:
+		struct LoopImbalance
+		{
+			LoopImbalance() : _loop( NULL ), _maxBusy( 0.0 ), _meanBusy( 0.0 ), _wastedTime( 0.0 ) {}
+			
+			LoopInfo*			_loop;
+			std::vector<double>	_busyTimes;		// Per thread
+			std::vector<int>	_numChunks;		// Per thread
+			double				_maxBusy;
+			double				_meanBusy;
+			double				_wastedTime;	// Idle thread time until the slowest thread finishes
+		};
+		
+		struct SiteImbalance
+		{
+			SiteImbalance() : _siteId( 0 ), _numInstances( 0 ), _totalTime( 0.0 ), _parallelTime( 0.0 ),
+							  _wastedTime( 0.0 ), _sumRatio( 0.0 ), _maxRatio( 0.0 ) {}
+			
+			uint32_t		_siteId;
+			unsigned int	_numInstances;
+			double			_totalTime;		// Sum of the loop instance times (slowest thread)
+			double			_parallelTime;	// Sum of the instance times multiplied by the number of threads
+			double			_wastedTime;
+			double			_sumRatio;
+			double			_maxRatio;
+		};
+		
+		static bool compareWastedTime( const SiteImbalance& a, const SiteImbalance& b ) 
+		{ 
+			return a._wastedTime > b._wastedTime; 
+		}
+		
+		std::string     			_logFilename;
+		std::vector<LoopImbalance>	_loops;
+		std::vector<SiteImbalance>	_sites;
+		double						_totalWastedTime;
+	};
+	
+	class IterationCostMetric : public Metric
+	{
+	public:
+		IterationCostMetric( const char* csvfile, unsigned int num_bins ) 
+			: _csvFilename( csvfile ), _maxBins( num_bins ) {}
+		
+		virtual void init( Graph* tdg );
+		virtual double getMetric( ) { return 0.0; }
+		virtual void printMetric( std::ostream& out_stream );
+		
+	private:
+		// Profile of the cost over the iteration space of one loop call site, merged 
+		// over all the instances of the loop. The space [_minIter, _maxIter] is divided
+		// into bins of equal width (in loop variable values).
+		struct SiteCostProfile
+		{
+			SiteCostProfile() : _siteId( 0 ), _numInstances( 0 ), _minIter( 0 ), _maxIter( 0 ),
+								_stride( 1 ), _binWidth( 1.0 ) {}
+			
+			uint32_t			_siteId;
+			unsigned int		_numInstances;
+			int64_t				_minIter;
+			int64_t				_maxIter;
+			int64_t				_stride;		// Absolute value of the loop step
+			double				_binWidth;
+			std::vector<double>	_binIters;		// Number of executed iterations per bin
+			std::vector<double>	_binCosts;		// Time (ms) per bin
+		};
+		
+		void addChunk( SiteCostProfile& profile, int64_t lower, int64_t upper, int64_t num_iters, double time );
+		
+		std::string     				_csvFilename;
+		unsigned int					_maxBins;
+		std::vector<SiteCostProfile>	_profiles;
+	};
+	
+	class ScheduleSimMetric : public Metric
+	{
+	public:
+		enum SimSchedule {
+			SIM_STATIC,
+			SIM_DYNAMIC,
+			SIM_GUIDED
+		};
+		
+		ScheduleSimMetric( const char* csvfile, double dispatch_overhead, unsigned int max_instances ) 
+			: _csvFilename( csvfile ), _dispatchOverhead( dispatch_overhead ), _maxInstances( max_instances ) {}
+		
+		virtual void init( Graph* tdg );
+		virtual double getMetric( ) { return 0.0; }
+		virtual void printMetric( std::ostream& out_stream );
+		
+	private:
+		// Piecewise constant cost of the iterations of one loop instance, built from its chunks.
+		// Iterations are numbered from 0 to _numIters - 1 regardless of the loop bounds and step.
+		struct CostModel
+		{
+			CostModel() : _numIters( 0 ) {}
+			
+			double prefixCost( int64_t iter ) const;
+			double cost( int64_t first, int64_t last ) const { return prefixCost( last ) - prefixCost( first ); }
+			
+			int64_t					_numIters;
+			std::vector<int64_t>	_segBegin;
+			std::vector<int64_t>	_segEnd;
+			std::vector<double>		_segIterCost;
+			std::vector<double>		_segPrefixCost;		// Cost of all the segments before this one
+		};
+		
+		struct SimConfig
+		{
+			SimConfig( SimSchedule sched, int64_t chunk ) : _sched( sched ), _chunk( chunk ), _time( 0.0 ) {}
+			
+			SimSchedule		_sched;
+			int64_t			_chunk;		// 0 - the default chunk of the schedule
+			double			_time;		// Predicted time of all the instances of the site
+		};
+		
+		struct SiteSim
+		{
+			SiteSim() : _siteId( 0 ), _numInstances( 0 ), _numSimulated( 0 ), _measuredTime( 0.0 ),
+						_recorded( SIM_DYNAMIC, 1 ), _best( SIM_STATIC, 0 ) {}
+			
+			uint32_t				_siteId;
+			unsigned int			_numInstances;
+			unsigned int			_numSimulated;
+			double					_measuredTime;
+			SimConfig				_recorded;
+			SimConfig				_best;
+			std::vector<SimConfig>	_configs;
+		};
+		
+		// The chunks are copied, the nodes of folded instances do not outlive the walk over them
+		struct SimChunk
+		{
+			int64_t		_lower;
+			int64_t		_upper;
+			int			_threadId;
+			double		_time;
+		};
+		
+		void buildCostModel( LoopInfo* loop, std::vector<SimChunk>& chunks, CostModel& model );
+		double simulate( const CostModel& model, unsigned int num_threads, SimSchedule sched, int64_t chunk );
+		static std::string configToStr( const SimConfig& config );
+		
+		std::string     		_csvFilename;
+		double					_dispatchOverhead;	// Time (ms) of getting a chunk from the runtime
+		unsigned int			_maxInstances;		// Max number of instances to simulate per site
+		std::vector<SiteSim>	_sites;
+	};
+	
+	class ToolCostMetric : public Metric
+	{
+	public:
+		ToolCostMetric( const char* csvfile, double threshold ) 
+			: _csvFilename( csvfile ), _threshold( threshold ), _totalToolTime( 0.0 ) {}
+		
+		virtual void init( Graph* tdg );
+		virtual double getMetric( ) { return _totalToolTime; }
+		virtual void printMetric( std::ostream& out_stream );
+		
+	private:
+		// Tool time in the chunks of one loop instance
+		struct LoopToolCost
+		{
+			LoopToolCost() : _loop( NULL ), _numChunks( 0 ), _chunksTime( 0.0 ), _toolTime( 0.0 ) {}
+			
+			LoopInfo*		_loop;
+			uint64_t		_numChunks;
+			double			_chunksTime;
+			double			_toolTime;
+		};
+		
+		struct SiteToolCost
+		{
+			SiteToolCost() : _siteId( 0 ), _numInstances( 0 ), _numChunks( 0 ), _chunksTime( 0.0 ), 
+							 _toolTime( 0.0 ) {}
+			
+			uint32_t		_siteId;
+			unsigned int	_numInstances;
+			uint64_t		_numChunks;
+			double			_chunksTime;
+			double			_toolTime;
+		};
+		
+		std::string					_csvFilename;
+		double						_threshold;		// Max tool time as a fraction of the chunks time
+		double						_totalToolTime;
+		std::vector<LoopToolCost>	_loops;
+		std::vector<SiteToolCost>	_sites;
+	};
+	
+	class SiteMetric : public Metric
+	{
+	public:
+		SiteMetric() : _criticalTime( 0.0 ) {}
+		
+		virtual void init( Graph* tdg );
+		virtual double getMetric( ) { return _criticalTime; }
+		virtual void printMetric( std::ostream& out_stream );
+		
+	private:
+		struct SiteSummary
+		{
+			SiteSummary() : _siteId( 0 ), _criticalTime( 0.0 ) {}
+			
+			uint32_t	_siteId;
+			SiteStats	_stats;
+			double		_criticalTime;	// Time of the nodes of the site on the critical path
+		};
+		
+		static bool compareImpact( const SiteSummary& a, const SiteSummary& b );
+		
+		std::vector<SiteSummary>	_sites;
+		double						_criticalTime;
+	};
+	
+	class SlackMetric : public Metric
+	{
+	public:
+		SlackMetric( const char* logfile, double slack_pct ) 
+		: _logFilename( logfile ), _slackPct( slack_pct ), _criticalTime( 0.0 ) {}
+		
+		virtual void init( Graph* tdg );
+		virtual double getMetric( ) { return _criticalTime; }
+		virtual void printMetric( std::ostream& out_stream );
+		
+	private:
+		static bool compareSlack( Node* a, Node* b );
+		
+		std::string			_logFilename;
+		double				_slackPct;		// Threshold in percent of the critical path time
+		double				_criticalTime;
+		std::vector<Node*>	_nearCritical;	// Sorted by slack
+	};
+	
+	class KPathsMetric : public Metric
+	{
+	public:
+		KPathsMetric( const char* logfile, unsigned int num_paths ) : _logFilename( logfile ), _numPaths( num_paths ) {}
+		
+		virtual void init( Graph* tdg );
+		virtual double getMetric( ) { return _paths.empty() ? 0.0 : _paths[0]._time; }
+		virtual void printMetric( std::ostream& out_stream );
+		
+	private:
+		// One of the longest paths that end in a node: the time of the path and the entry of 
+		// the predecessor it extends
+		struct PathEntry
+		{
+			double		_time;
+			int64_t		_pred;			// Index of the predecessor in the topological order, -1 for sources
+			unsigned int	_predEntry;
+		};
+		
+		struct Path
+		{
+			double				_time;
+			std::vector<Node*>	_nodes;		// From source to sink
+		};
+		
+		std::string			_logFilename;
+		unsigned int		_numPaths;
+		std::vector<Path>	_paths;		// Sorted by time
+	};
+	
+	// Predicts the span of the graph when some nodes become faster. The finish times of the recorded
+	// graph are computed once, every query recomputes only the downstream cone of the changed nodes.
+	class WhatIfAnalysis {
+	public:
+		WhatIfAnalysis( Graph* tdg );
+		
+		double getSpan() const { return _span; }
+		
+		// The times of the nodes are divided by the speedup and the new times are set, returns the new span
+		double predictSpan( const std::vector<Node*>& nodes, double speedup,
+							const std::vector< std::pair<Node*, double> >& new_times = std::vector< std::pair<Node*, double> >() );
+		double predictSiteSpan( uint32_t site_id, double speedup );
+		
+		// The same prediction from a pass over the whole graph, to check the incremental one
+		double recomputeSpan( const std::vector<Node*>& nodes, double speedup,
+							  const std::vector< std::pair<Node*, double> >& new_times = std::vector< std::pair<Node*, double> >() ) const;
+		
+		const std::vector<Node*>& getSiteNodes( uint32_t site_id ) { return _siteNodes[site_id]; }
+		std::vector<uint32_t> getSites() const;
+		
+	private:
+		double finishTime( size_t idx, const std::unordered_map<size_t, double>& new_finish ) const;
+		
+		std::vector<Node*>					_nodes;			// In topological order
+		std::unordered_map<Node*, size_t>	_nodeIdx;
+		std::vector<double>					_finishTimes;
+		std::vector<size_t>					_sinks;			// Sorted by finish time, longest first
+		std::unordered_map< uint32_t, std::vector<Node*> >	_siteNodes;		// Without the nodes of folded instances
+		double								_span;
+	};
+	
+	class WhatIfMetric : public Metric
+	{
+	public:
+		WhatIfMetric( double speedup, bool check ) : _speedup( speedup ), _check( check ), _span( 0.0 ), _maxError( 0.0 ) {}
+		
+		virtual void init( Graph* tdg );
+		virtual double getMetric( ) { return _span; }
+		virtual void printMetric( std::ostream& out_stream );
+		
+	private:
+		struct SiteWhatIf
+		{
+			uint32_t	_siteId;
+			double		_work;
+			double		_newSpan;
+		};
+		
+		static bool compareSpan( const SiteWhatIf& a, const SiteWhatIf& b ) { return a._newSpan < b._newSpan; }
+		
+		double					_speedup;
+		bool					_check;		// Compare every prediction with a full recomputation
+		double					_span;
+		double					_maxError;	// Of the predictions, when checked
+		std::vector<SiteWhatIf>	_sites;		// Sorted by the predicted span
+	};
+	
+	// Extrapolates the work and the critical path of the top-level regions from the instances that
+	// were sampled (TDG_SAMPLE), with 95% confidence intervals
+	class SampleMetric : public Metric
+	{
+	public:
+		SampleMetric() : _work( 0.0 ), _workErr( 0.0 ), _span( 0.0 ), _spanErr( 0.0 ), _countedWork( 0.0 ) {}
+		
+		virtual void init( Graph* tdg );
+		virtual double getMetric( ) { return _work; }
+		virtual void printMetric( std::ostream& out_stream );
+		
+	private:
+		struct SiteEstimate
+		{
+			uint32_t	_siteId;
+			uint64_t	_numInstances;
+			uint64_t	_numSampled;
+			double		_work;
+			double		_workErr;
+			double		_span;
+			double		_spanErr;
+			double		_countedWork;
+		};
+		
+		static void estimate( uint64_t num_instances, uint64_t num_sampled, double sum, double sq_sum, 
+							  double& total, double& err );
+		
+		double						_work;
+		double						_workErr;
+		double						_span;
+		double						_spanErr;
+		double						_countedWork;
+		std::vector<SiteEstimate>	_sites;
+	};
+	
+	// Cycles spent in the callbacks of the tool, merged over the threads and per thread
+	class SelfMetric : public Metric
+	{
+	public:
+		SelfMetric() : _callbacks( NUM_TOOL_CALLBACKS ), _totalCycles( 0 ), _work( 0.0 ) {}
+		
+		virtual void init( Graph* tdg );
+		virtual double getMetric( ) { return cyclesToMsec( _totalCycles ); }
+		virtual void printMetric( std::ostream& out_stream );
+		
+	private:
+		static double cyclesToMsec( uint64_t cycles );
+		
+		std::vector<CallbackStats>	_callbacks;
+		std::vector<uint64_t>		_threadCalls;
+		std::vector<uint64_t>		_threadCycles;
+		uint64_t					_totalCycles;
+		double						_work;		// Time of the nodes of the graph
+	};
+	
 	class LogFileMetric : public Metric
 	{
 	public:
@@ -0,0 +1,123 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "monitor.h"
+
+
+using namespace libtdg;
+
+
+static void segment_name( int pid, char* name, size_t size )
+{
+	snprintf( name, size, "/libtdg.%d", pid );
+}
+
+
+uint64_t libtdg::monitor_time_ns()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+MonitorSegment* libtdg::create_monitor_segment()
+{
+	char name[64];
+	segment_name( getpid(), name, sizeof( name ) );
+	
+	int fd = shm_open( name, O_CREAT | O_RDWR | O_TRUNC, 0644 );
+	if( fd < 0 )
+	{
+		std::cerr << "libtdg: cannot create shared memory segment " << name << std::endl;
+		return NULL;
+	}
+	if( ftruncate( fd, sizeof( MonitorSegment ) ) != 0 )
+	{
+		std::cerr << "libtdg: cannot resize shared memory segment " << name << std::endl;
+		close( fd );
+		shm_unlink( name );
+		return NULL;
+	}
+	void* addr = mmap( NULL, sizeof( MonitorSegment ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	if( addr == MAP_FAILED )
+	{
+		shm_unlink( name );
+		return NULL;
+	}
+	
+	// The segment is zero-filled, the counters start at 0. The magic is written last.
+	MonitorSegment* segment = (MonitorSegment*)addr;
+	segment->_version = MONITOR_VERSION;
+	segment->_pid = getpid();
+	segment->_startNs = monitor_time_ns();
+	std::atomic_thread_fence( std::memory_order_release );
+	segment->_magic = MONITOR_MAGIC;
+	
+	return segment;
+}
+
+
+void libtdg::destroy_monitor_segment( MonitorSegment* segment )
+{
+	char name[64];
+	segment_name( segment->_pid, name, sizeof( name ) );
+	munmap( segment, sizeof( MonitorSegment ) );
+	shm_unlink( name );
+}
+
+
+const MonitorSegment* libtdg::attach_monitor_segment( int pid )
+{
+	char name[64];
+	segment_name( pid, name, sizeof( name ) );
+	
+	int fd = shm_open( name, O_RDONLY, 0 );
+	if( fd < 0 )
+		return NULL;
+	void* addr = mmap( NULL, sizeof( MonitorSegment ), PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+	if( addr == MAP_FAILED )
+		return NULL;
+	
+	const MonitorSegment* segment = (const MonitorSegment*)addr;
+	if( segment->_magic != MONITOR_MAGIC || segment->_version != MONITOR_VERSION )
+	{
+		munmap( addr, sizeof( MonitorSegment ) );
+		return NULL;
+	}
+	return segment;
+}
+
+
+void libtdg::detach_monitor_segment( const MonitorSegment* segment )
+{
+	munmap( (void*)segment, sizeof( MonitorSegment ) );
+}
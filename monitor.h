@@ -0,0 +1,78 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef __MONITOR_H__
+#define __MONITOR_H__
+
+#include <cstdint>
+#include <atomic>
+
+
+#define MONITOR_MAGIC			0x4d474454		// "TDGM"
+#define MONITOR_VERSION			1
+#define MONITOR_MAX_THREADS		256
+
+
+namespace libtdg
+{
+	// Live counters of one thread. Every counter has a single writer, the thread itself, so it
+	// is updated with a relaxed load and store instead of a locked instruction.
+	struct alignas( 64 ) MonitorThread
+	{
+		std::atomic<uint64_t>	_nodes;			// Nodes created by the thread
+		std::atomic<uint64_t>	_chunks;
+		std::atomic<uint64_t>	_busyNs;		// Time in tasks, without the waits in barriers and taskwaits
+		std::atomic<uint64_t>	_toolNs;		// Time in the chunk callbacks
+	};
+	
+	// The shared memory segment "/libtdg.<pid>" read by tdg-top. Times are in ns, the start time
+	// is from CLOCK_MONOTONIC so that the monitor can compute the elapsed time itself.
+	struct MonitorSegment
+	{
+		uint32_t				_magic;
+		uint32_t				_version;
+		int32_t					_pid;
+		uint64_t				_startNs;
+		std::atomic<uint32_t>	_numThreads;
+		std::atomic<uint64_t>	_numRegions;	// Completed top-level regions
+		std::atomic<uint64_t>	_savedNs;		// Duration minus critical path of the completed top-level regions
+		MonitorThread			_threads[MONITOR_MAX_THREADS];
+	};
+	
+	inline void monitor_add( std::atomic<uint64_t>& counter, uint64_t value )
+	{
+		counter.store( counter.load( std::memory_order_relaxed ) + value, std::memory_order_relaxed );
+	}
+	
+	uint64_t monitor_time_ns();
+	
+	// Creates and maps the segment of this process, returns NULL on failure
+	MonitorSegment* create_monitor_segment();
+	
+	void destroy_monitor_segment( MonitorSegment* segment );
+	
+	// Maps the segment of another process read-only, returns NULL if there is none
+	const MonitorSegment* attach_monitor_segment( int pid );
+	
+	void detach_monitor_segment( const MonitorSegment* segment );
+}
+
+
+#endif	// __MONITOR_H__
@@ -0,0 +1,525 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+
+#include <dlfcn.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "symbols.h"
+
+
+using namespace libtdg;
+
+
+// DWARF constants used by the line table decoder
+#define DW_LNS_copy					1
+#define DW_LNS_advance_pc			2
+#define DW_LNS_advance_line			3
+#define DW_LNS_set_file				4
+#define DW_LNS_const_add_pc			8
+#define DW_LNS_fixed_advance_pc		9
+
+#define DW_LNE_end_sequence			1
+#define DW_LNE_set_address			2
+
+#define DW_LNCT_path				1
+#define DW_LNCT_directory_index		2
+
+#define DW_FORM_block				0x09
+#define DW_FORM_block1				0x0a
+#define DW_FORM_block2				0x03
+#define DW_FORM_block4				0x04
+#define DW_FORM_data1				0x0b
+#define DW_FORM_data2				0x05
+#define DW_FORM_data4				0x06
+#define DW_FORM_data8				0x07
+#define DW_FORM_data16				0x1e
+#define DW_FORM_string				0x08
+#define DW_FORM_strp				0x0e
+#define DW_FORM_line_strp			0x1f
+#define DW_FORM_udata				0x0f
+#define DW_FORM_sdata				0x0d
+
+
+namespace
+{
+	// Bounds checked reader of DWARF data, a read past the end sets the error flag
+	struct DwarfReader
+	{
+		DwarfReader( const uint8_t* data, uint64_t size ) : _pos( data ), _end( data + size ), _error( false ) {}
+
+		bool atEnd() const { return _pos >= _end || _error; }
+
+		uint64_t readFixed( unsigned int num_bytes )
+		{
+			uint64_t val = 0;
+			if( (uint64_t)(_end - _pos) < num_bytes )
+			{
+				_error = true;
+				_pos = _end;
+				return 0;
+			}
+			for( unsigned int i = 0; i < num_bytes; ++i )	// Little endian
+				val |= (uint64_t)_pos[i] << (8 * i);
+			_pos += num_bytes;
+			return val;
+		}
+
+		uint64_t readULEB()
+		{
+			uint64_t val = 0;
+			unsigned int shift = 0;
+			while( _pos < _end )
+			{
+				uint8_t byte = *_pos++;
+				if( shift < 64 )
+					val |= (uint64_t)(byte & 0x7f) << shift;
+				shift += 7;
+				if( !(byte & 0x80) )
+					return val;
+			}
+			_error = true;
+			return val;
+		}
+
+		int64_t readSLEB()
+		{
+			int64_t val = 0;
+			unsigned int shift = 0;
+			while( _pos < _end )
+			{
+				uint8_t byte = *_pos++;
+				if( shift < 64 )
+					val |= (int64_t)(byte & 0x7f) << shift;
+				shift += 7;
+				if( !(byte & 0x80) )
+				{
+					if( shift < 64 && (byte & 0x40) )
+						val |= -((int64_t)1 << shift);
+					return val;
+				}
+			}
+			_error = true;
+			return val;
+		}
+
+		const char* readString()
+		{
+			const char* str = (const char*)_pos;
+			const uint8_t* nul = (const uint8_t*)memchr( _pos, 0, _end - _pos );
+			if( !nul )
+			{
+				_error = true;
+				_pos = _end;
+				return "";
+			}
+			_pos = nul + 1;
+			return str;
+		}
+
+		void skip( uint64_t num_bytes )
+		{
+			if( (uint64_t)(_end - _pos) < num_bytes )
+			{
+				_error = true;
+				_pos = _end;
+			}
+			else
+			{
+				_pos += num_bytes;
+			}
+		}
+
+		const uint8_t*	_pos;
+		const uint8_t*	_end;
+		bool			_error;
+	};
+
+	const char* string_at( const uint8_t* section, uint64_t size, uint64_t offset )
+	{
+		if( !section || offset >= size || !memchr( section + offset, 0, size - offset ) )
+			return "";
+		return (const char*)(section + offset);
+	}
+
+	// Reads one attribute of a DWARF 5 directory or file entry. Strings are returned in str_val,
+	// everything else in int_val. Returns false for forms the decoder does not support.
+	bool read_entry_form( DwarfReader& reader, uint64_t form, unsigned int offset_size,
+						  const uint8_t* line_str, uint64_t line_str_size, const uint8_t* str, uint64_t str_size,
+						  const char*& str_val, uint64_t& int_val )
+	{
+		switch( form )
+		{
+		case DW_FORM_string:	str_val = reader.readString(); break;
+		case DW_FORM_line_strp:	str_val = string_at( line_str, line_str_size, reader.readFixed( offset_size ) ); break;
+		case DW_FORM_strp:		str_val = string_at( str, str_size, reader.readFixed( offset_size ) ); break;
+		case DW_FORM_udata:		int_val = reader.readULEB(); break;
+		case DW_FORM_sdata:		int_val = reader.readSLEB(); break;
+		case DW_FORM_data1:		int_val = reader.readFixed( 1 ); break;
+		case DW_FORM_data2:		int_val = reader.readFixed( 2 ); break;
+		case DW_FORM_data4:		int_val = reader.readFixed( 4 ); break;
+		case DW_FORM_data8:		int_val = reader.readFixed( 8 ); break;
+		case DW_FORM_data16:	reader.skip( 16 ); break;
+		case DW_FORM_block:		reader.skip( reader.readULEB() ); break;
+		case DW_FORM_block1:	reader.skip( reader.readFixed( 1 ) ); break;
+		case DW_FORM_block2:	reader.skip( reader.readFixed( 2 ) ); break;
+		case DW_FORM_block4:	reader.skip( reader.readFixed( 4 ) ); break;
+		default:				return false;
+		}
+		return !reader._error;
+	}
+
+	std::string join_path( const std::string& dir, const char* file )
+	{
+		if( dir.empty() || file[0] == '/' )
+			return file;
+		return dir + "/" + file;
+	}
+}
+
+
+//========================== SymbolResolver ======================================
+
+SymbolResolver::~SymbolResolver()
+{
+	for( std::map<std::string, ModuleLines*>::iterator it = _modules.begin(); it != _modules.end(); ++it )
+		delete it->second;
+}
+
+std::string SymbolResolver::resolve( const void* addr )
+{
+	std::stringstream ss;
+	Dl_info info;
+
+	if( !addr || !dladdr( addr, &info ) || !info.dli_fbase )
+	{
+		ss << addr;
+		return ss.str();
+	}
+
+	// The main program may be reported without a path
+	std::string path = (info.dli_fname && strchr( info.dli_fname, '/' )) ? info.dli_fname : "/proc/self/exe";
+
+	// codeptr_ra is a return address, the call instruction is right before it
+	uint64_t offset = (uint64_t)addr - (uint64_t)info.dli_fbase;
+	ModuleLines* module = getModule( path );
+	if( module && !module->_rows.empty() )
+	{
+		LineRow key;
+		key._addr = module->_baseVaddr + offset - 1;
+		key._file = 0;
+		key._line = UINT32_MAX;
+		std::vector<LineRow>::iterator it = std::upper_bound( module->_rows.begin(), module->_rows.end(), key );
+		if( it != module->_rows.begin() && (--it)->_line != 0 )
+		{
+			ss << module->_files[it->_file] << ":" << it->_line;
+			return ss.str();
+		}
+	}
+
+	if( info.dli_sname && info.dli_saddr )
+		ss << info.dli_sname << "+0x" << std::hex << ((uint64_t)addr - (uint64_t)info.dli_saddr);
+	else
+		ss << path.substr( path.rfind( '/' ) + 1 ) << "+0x" << std::hex << offset;
+	return ss.str();
+}
+
+SymbolResolver::ModuleLines* SymbolResolver::getModule( const std::string& path )
+{
+	std::map<std::string, ModuleLines*>::iterator it = _modules.find( path );
+	if( it != _modules.end() )
+		return it->second;
+
+	ModuleLines* module = new ModuleLines;
+	if( !loadModule( path, module ) )
+	{
+		delete module;
+		module = NULL;
+	}
+	_modules[path] = module;
+	return module;
+}
+
+bool SymbolResolver::loadModule( const std::string& path, ModuleLines* module )
+{
+	int fd = open( path.c_str(), O_RDONLY );
+	if( fd < 0 )
+		return false;
+
+	struct stat st;
+	if( fstat( fd, &st ) != 0 || st.st_size < (off_t)sizeof(Elf64_Ehdr) )
+	{
+		close( fd );
+		return false;
+	}
+	uint64_t file_size = st.st_size;
+	void* mapping = mmap( NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if( mapping == MAP_FAILED )
+		return false;
+
+	const uint8_t* file = (const uint8_t*)mapping;
+	const Elf64_Ehdr* ehdr = (const Elf64_Ehdr*)file;
+	bool res = false;
+
+	// Only 64-bit little endian objects are supported
+	if( memcmp( ehdr->e_ident, ELFMAG, SELFMAG ) == 0 && ehdr->e_ident[EI_CLASS] == ELFCLASS64 &&
+		ehdr->e_ident[EI_DATA] == ELFDATA2LSB && ehdr->e_shoff + (uint64_t)ehdr->e_shnum * sizeof(Elf64_Shdr) <= file_size &&
+		ehdr->e_phoff + (uint64_t)ehdr->e_phnum * sizeof(Elf64_Phdr) <= file_size && ehdr->e_shstrndx < ehdr->e_shnum )
+	{
+		const Elf64_Phdr* phdrs = (const Elf64_Phdr*)(file + ehdr->e_phoff);
+		uint64_t base_vaddr = UINT64_MAX;
+		for( unsigned int i = 0; i < ehdr->e_phnum; ++i )
+			if( phdrs[i].p_type == PT_LOAD )
+				base_vaddr = std::min( base_vaddr, (uint64_t)phdrs[i].p_vaddr );
+		long page_size = sysconf( _SC_PAGESIZE );
+		module->_baseVaddr = (base_vaddr == UINT64_MAX) ? 0 : (base_vaddr & ~((uint64_t)page_size - 1));
+
+		const Elf64_Shdr* shdrs = (const Elf64_Shdr*)(file + ehdr->e_shoff);
+		const Elf64_Shdr& shstr_hdr = shdrs[ehdr->e_shstrndx];
+		const uint8_t* shstr = (shstr_hdr.sh_offset + shstr_hdr.sh_size <= file_size) ? file + shstr_hdr.sh_offset : NULL;
+		const uint8_t* sections[3] = { NULL, NULL, NULL };
+		uint64_t sizes[3] = { 0, 0, 0 };
+		const char* names[3] = { ".debug_line", ".debug_line_str", ".debug_str" };
+
+		for( unsigned int i = 0; shstr && i < ehdr->e_shnum; ++i )
+		{
+			const char* name = string_at( shstr, shstr_hdr.sh_size, shdrs[i].sh_name );
+			for( unsigned int j = 0; j < 3; ++j )
+			{
+				// Compressed debug sections are not supported
+				if( strcmp( name, names[j] ) == 0 && shdrs[i].sh_type != SHT_NOBITS && !(shdrs[i].sh_flags & SHF_COMPRESSED) &&
+					shdrs[i].sh_offset + shdrs[i].sh_size <= file_size )
+				{
+					sections[j] = file + shdrs[i].sh_offset;
+					sizes[j] = shdrs[i].sh_size;
+				}
+			}
+		}
+
+		if( sections[0] )
+			res = decodeLineTable( sections[0], sizes[0], sections[1], sizes[1], sections[2], sizes[2], module );
+	}
+
+	munmap( mapping, file_size );
+	return res;
+}
+
+// Runs the line number programs of all the units in .debug_line (DWARF versions 2 to 5) and
+// keeps one row per change of file or line
+bool SymbolResolver::decodeLineTable( const uint8_t* data, uint64_t size, const uint8_t* line_str, uint64_t line_str_size,
+									  const uint8_t* str, uint64_t str_size, ModuleLines* module )
+{
+	DwarfReader section( data, size );
+
+	while( !section.atEnd() )
+	{
+		unsigned int offset_size = 4;
+		uint64_t unit_length = section.readFixed( 4 );
+		if( unit_length == 0xffffffff )
+		{
+			offset_size = 8;
+			unit_length = section.readFixed( 8 );
+		}
+		if( section._error || unit_length > (uint64_t)(section._end - section._pos) )
+			break;
+		const uint8_t* unit_end = section._pos + unit_length;
+		DwarfReader unit( section._pos, unit_length );
+		section._pos = unit_end;
+
+		unsigned int version = unit.readFixed( 2 );
+		if( version < 2 || version > 5 )
+			continue;
+		unsigned int address_size = 8;
+		if( version >= 5 )
+		{
+			address_size = unit.readFixed( 1 );
+			unit.readFixed( 1 );	// segment selector size
+		}
+		uint64_t header_length = unit.readFixed( offset_size );
+		if( unit._error || header_length > (uint64_t)(unit._end - unit._pos) )
+			continue;
+		const uint8_t* program_start = unit._pos + header_length;
+
+		unsigned int min_inst_length = unit.readFixed( 1 );
+		if( version >= 4 )
+			unit.readFixed( 1 );	// maximum operations per instruction, only VLIW uses it
+		unit.readFixed( 1 );	// default is_stmt, all the rows are kept
+		int line_base = (int8_t)unit.readFixed( 1 );
+		unsigned int line_range = unit.readFixed( 1 );
+		unsigned int opcode_base = unit.readFixed( 1 );
+		std::vector<uint8_t> opcode_lengths( opcode_base, 0 );
+		for( unsigned int i = 1; i < opcode_base; ++i )
+			opcode_lengths[i] = unit.readFixed( 1 );
+		if( unit._error || line_range == 0 )
+			continue;
+
+		// Files of the unit as indices in the files of the module. In DWARF 5 the file
+		// numbers start from 0, before that from 1 (entry 0 is left unused).
+		std::vector<uint32_t> unit_files;
+		bool header_ok = true;
+		if( version < 5 )
+		{
+			std::vector<std::string> dirs( 1, "" );
+			for( const char* dir = unit.readString(); *dir; dir = unit.readString() )
+				dirs.push_back( dir );
+			unit_files.push_back( 0 );
+			for( const char* file = unit.readString(); *file && !unit._error; file = unit.readString() )
+			{
+				uint64_t dir_idx = unit.readULEB();
+				unit.readULEB();	// modification time
+				unit.readULEB();	// file length
+				unit_files.push_back( module->_files.size() );
+				module->_files.push_back( join_path( dir_idx < dirs.size() ? dirs[dir_idx] : "", file ) );
+			}
+		}
+		else
+		{
+			std::vector<std::string> dirs;
+			for( unsigned int table = 0; table < 2 && header_ok; ++table )
+			{
+				unsigned int format_count = unit.readFixed( 1 );
+				std::vector< std::pair<uint64_t, uint64_t> > formats;
+				for( unsigned int i = 0; i < format_count; ++i )
+				{
+					uint64_t content_type = unit.readULEB();
+					formats.push_back( std::make_pair( content_type, unit.readULEB() ) );
+				}
+				uint64_t entry_count = unit.readULEB();
+				for( uint64_t e = 0; e < entry_count && header_ok; ++e )
+				{
+					const char* path = "";
+					uint64_t dir_idx = 0;
+					for( unsigned int i = 0; i < formats.size() && header_ok; ++i )
+					{
+						const char* str_val = "";
+						uint64_t int_val = 0;
+						header_ok = read_entry_form( unit, formats[i].second, offset_size, line_str, line_str_size,
+													 str, str_size, str_val, int_val );
+						if( formats[i].first == DW_LNCT_path )
+							path = str_val;
+						else if( formats[i].first == DW_LNCT_directory_index )
+							dir_idx = int_val;
+					}
+					if( table == 0 )
+					{
+						dirs.push_back( path );
+					}
+					else
+					{
+						unit_files.push_back( module->_files.size() );
+						module->_files.push_back( join_path( dir_idx < dirs.size() ? dirs[dir_idx] : "", path ) );
+					}
+				}
+			}
+		}
+		if( !header_ok || unit._error || unit_files.size() < ((version < 5) ? 2u : 1u) || program_start > unit._end )
+			continue;
+
+		// The line number program
+		DwarfReader program( program_start, unit_end - program_start );
+		uint64_t address = 0;
+		uint64_t file = 1;
+		int64_t line = 1;
+		LineRow last_row;
+		last_row._addr = 0;
+		last_row._file = UINT32_MAX;
+		last_row._line = 0;
+
+		while( !program.atEnd() )
+		{
+			bool emit_row = false;
+			bool end_sequence = false;
+			unsigned int opcode = program.readFixed( 1 );
+
+			if( opcode >= opcode_base )
+			{
+				unsigned int adjusted = opcode - opcode_base;
+				address += (adjusted / line_range) * min_inst_length;
+				line += line_base + (int)(adjusted % line_range);
+				emit_row = true;
+			}
+			else if( opcode == 0 )
+			{
+				uint64_t length = program.readULEB();
+				if( length == 0 || length > (uint64_t)(program._end - program._pos) )
+					break;
+				const uint8_t* next = program._pos + length;
+				unsigned int sub_opcode = program.readFixed( 1 );
+				if( sub_opcode == DW_LNE_end_sequence )
+				{
+					emit_row = true;
+					end_sequence = true;
+				}
+				else if( sub_opcode == DW_LNE_set_address )
+				{
+					address = program.readFixed( std::min( (unsigned int)(length - 1), address_size ) );
+				}
+				program._pos = next;
+			}
+			else
+			{
+				switch( opcode )
+				{
+				case DW_LNS_copy:				emit_row = true; break;
+				case DW_LNS_advance_pc:			address += program.readULEB() * min_inst_length; break;
+				case DW_LNS_advance_line:		line += program.readSLEB(); break;
+				case DW_LNS_set_file:			file = program.readULEB(); break;
+				case DW_LNS_const_add_pc:		address += ((255 - opcode_base) / line_range) * min_inst_length; break;
+				case DW_LNS_fixed_advance_pc:	address += program.readFixed( 2 ); break;
+				default:
+					for( unsigned int i = 0; i < opcode_lengths[opcode]; ++i )
+						program.readULEB();
+					break;
+				}
+			}
+
+			if( emit_row && !program._error )
+			{
+				LineRow row;
+				row._addr = address;
+				row._file = (file < unit_files.size()) ? unit_files[file] : unit_files.back();
+				row._line = (end_sequence || line < 0) ? 0 : (uint32_t)line;
+				if( end_sequence || row._file != last_row._file || row._line != last_row._line )
+				{
+					module->_rows.push_back( row );
+					last_row = row;
+				}
+			}
+			if( end_sequence )
+			{
+				address = 0;
+				file = 1;
+				line = 1;
+				last_row._file = UINT32_MAX;
+			}
+		}
+	}
+
+	std::stable_sort( module->_rows.begin(), module->_rows.end() );
+	return !module->_rows.empty();
+}
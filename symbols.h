@@ -0,0 +1,76 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef __SYMBOLS_H__
+#define __SYMBOLS_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+
+
+namespace libtdg
+{
+	// Translates code addresses (codeptr_ra) to "file:line". The module of an address is found
+	// with dladdr and the DWARF line table (.debug_line) of each module is decoded only once.
+	// Addresses without line information are printed as "symbol+offset" or "module+offset".
+	class SymbolResolver {
+	public:
+		SymbolResolver() {}
+		~SymbolResolver();
+
+		std::string resolve( const void* addr );
+
+	private:
+		struct LineRow
+		{
+			uint64_t	_addr;
+			uint32_t	_file;		// Index in the files of the module
+			uint32_t	_line;		// 0 marks the end of a sequence
+
+			bool operator<( const LineRow& other ) const
+			{
+				// End of sequence rows go first so that a sequence that starts where
+				// another one ends is found by the lookup
+				return (_addr != other._addr) ? (_addr < other._addr) : (_line < other._line);
+			}
+		};
+
+		struct ModuleLines
+		{
+			ModuleLines() : _baseVaddr( 0 ) {}
+
+			uint64_t					_baseVaddr;	// Link time address of the first loaded page
+			std::vector<LineRow>		_rows;		// Sorted by address
+			std::vector<std::string>	_files;
+		};
+
+		ModuleLines* getModule( const std::string& path );
+		bool loadModule( const std::string& path, ModuleLines* module );
+		bool decodeLineTable( const uint8_t* data, uint64_t size, const uint8_t* line_str, uint64_t line_str_size,
+							  const uint8_t* str, uint64_t str_size, ModuleLines* module );
+
+		std::map<std::string, ModuleLines*>	_modules;	// NULL for modules without line information
+	};
+}
+
+
+#endif	// __SYMBOLS_H__
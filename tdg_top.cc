@@ -0,0 +1,115 @@
+// Copyright (c) 2018 Sergei Shudler
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <vector>
+
+#include <signal.h>
+#include <unistd.h>
+
+#include "monitor.h"
+
+
+using namespace libtdg;
+
+
+// tdg-top <pid> [interval in s]
+//
+// Shows the live counters that libtdg publishes when the program runs with TDG_MONITOR=1.
+// The rates are computed from the difference between two refreshes.
+int main( int argc, char** argv )
+{
+	if( argc < 2 )
+	{
+		fprintf( stderr, "usage: %s <pid> [interval in s]\n", argv[0] );
+		return 1;
+	}
+	int pid = atoi( argv[1] );
+	double interval = (argc > 2) ? atof( argv[2] ) : 1.0;
+	if( interval <= 0.0 )
+		interval = 1.0;
+	
+	const MonitorSegment* segment = attach_monitor_segment( pid );
+	if( !segment )
+	{
+		fprintf( stderr, "tdg-top: no libtdg segment for pid %d (is TDG_MONITOR=1 set?)\n", pid );
+		return 1;
+	}
+	
+	std::vector<uint64_t> last_chunks( MONITOR_MAX_THREADS, 0 );
+	uint64_t last_nodes = 0, last_time = monitor_time_ns();
+	
+	while( kill( pid, 0 ) == 0 )
+	{
+		usleep( (useconds_t)(interval * 1e6) );
+		
+		uint64_t curr_time = monitor_time_ns();
+		double elapsed = (curr_time - segment->_startNs) * 1e-9;
+		double period = (curr_time - last_time) * 1e-9;
+		uint32_t num_threads = segment->_numThreads.load( std::memory_order_relaxed );
+		if( num_threads > MONITOR_MAX_THREADS )
+			num_threads = MONITOR_MAX_THREADS;
+		
+		uint64_t nodes = 0, chunks = 0, new_chunks = 0, busy_ns = 0, tool_ns = 0;
+		for( uint32_t i = 0; i < num_threads; ++i )
+		{
+			const MonitorThread& thread = segment->_threads[i];
+			uint64_t thread_chunks = thread._chunks.load( std::memory_order_relaxed );
+			nodes += thread._nodes.load( std::memory_order_relaxed );
+			chunks += thread_chunks;
+			new_chunks += thread_chunks - last_chunks[i];
+			busy_ns += thread._busyNs.load( std::memory_order_relaxed );
+			tool_ns += thread._toolNs.load( std::memory_order_relaxed );
+		}
+		
+		// Regions in progress are counted as if they were serial
+		double critical_path = elapsed - segment->_savedNs.load( std::memory_order_relaxed ) * 1e-9;
+		
+		printf( "\033[H\033[2J" );
+		printf( "libtdg pid %d, elapsed %.1f s, threads %u, top-level regions %llu\n", pid, elapsed, num_threads,
+				(unsigned long long)segment->_numRegions.load( std::memory_order_relaxed ) );
+		printf( "critical path estimate %.3f s, nodes %llu (%.0f/s), chunks %llu (%.0f/s)\n", critical_path,
+				(unsigned long long)nodes, (nodes - last_nodes) / period, (unsigned long long)chunks, new_chunks / period );
+		printf( "busy %.3f s, time in chunk callbacks %.3f s (%.2f%%)\n\n", busy_ns * 1e-9, tool_ns * 1e-9,
+				busy_ns ? (100.0 * tool_ns / busy_ns) : 0.0 );
+		printf( "%6s %10s %6s %10s %10s %10s %10s\n", "thread", "busy(s)", "util", "nodes", "chunks", "chunks/s", "tool(ms)" );
+		for( uint32_t i = 0; i < num_threads; ++i )
+		{
+			const MonitorThread& thread = segment->_threads[i];
+			uint64_t thread_chunks = thread._chunks.load( std::memory_order_relaxed );
+			double thread_busy = thread._busyNs.load( std::memory_order_relaxed ) * 1e-9;
+			printf( "%6u %10.3f %5.1f%% %10llu %10llu %10.0f %10.3f\n", i, thread_busy, 
+					(elapsed > 0.0) ? (100.0 * thread_busy / elapsed) : 0.0,
+					(unsigned long long)thread._nodes.load( std::memory_order_relaxed ),
+					(unsigned long long)thread_chunks, (thread_chunks - last_chunks[i]) / period,
+					thread._toolNs.load( std::memory_order_relaxed ) * 1e-6 );
+			last_chunks[i] = thread_chunks;
+		}
+		fflush( stdout );
+		
+		last_nodes = nodes;
+		last_time = curr_time;
+	}
+	
+	detach_monitor_segment( segment );
+	return 0;
+}
@@ -0,0 +1,19 @@
+export LD_LIBRARY_PATH=${LD_LIBRARY_PATH}:${HOME}/ompt/llvm_omp_root/lib
+
+# Wall time (ms) of the examples without the tool and with every TDG_LEVEL. Build libtdg.so,
+# test/loop, mm/omp_mm and fib/fib first, and run from the test directory.
+run()
+{
+	start=$(date +%s%N)
+	"$@" > /dev/null
+	echo $(( ($(date +%s%N) - start) / 1000000 ))
+}
+
+for example in "./loop 10" "../mm/omp_mm 1000 1000 1000" "../fib/fib 30 0"
+do
+	echo "$example: none $(OMP_NUM_THREADS=2 run $example) ms"
+	for level in regions loops chunks tasks full
+	do
+		echo "$example: $level $(LD_PRELOAD=../libtdg.so TDG_LEVEL=$level OMP_NUM_THREADS=2 run $example) ms"
+	done
+done
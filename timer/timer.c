@@ -66,3 +66,13 @@ static double get_clock_time() {
 void 	ftimer_init() { init_clock_time(); }
 double 	ftimer_msec() { return get_clock_time(); }
 
+/* The TSC without the serializing cpuid, for intervals of a few hundred cycles */
+unsigned long long 	ftimer_cycles() 
+{ 
+        UINT32_T l, h;
+        __asm__ __volatile__ ( "rdtsc" : "=a" (l), "=d" (h) );
+        return ((( UINT64_T ) h) << 32) | l;
+}
+
+unsigned long long 	ftimer_freq() { return g_timerfreq; }
+
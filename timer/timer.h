@@ -29,6 +29,8 @@ extern "C"
 #endif
 	void 	ftimer_init();
 	double 	ftimer_msec();
+	unsigned long long 	ftimer_cycles();	// Raw TSC, not serialized
+	unsigned long long 	ftimer_freq();		// TSC cycles per second
 #ifdef __cplusplus
 }
 #endif